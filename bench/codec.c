@@ -0,0 +1,220 @@
+#define _POSIX_C_SOURCE 200809L
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "audio.h"
+#include "codec.h"
+
+#define DURATION_SEC 30
+#define ITERATIONS 5
+
+#ifndef M_PI
+# define M_PI 3.14159265358979323846
+#endif
+
+static uint32_t rand_state = 42;
+
+// deterministic, so that the results are reproducible
+static float
+noise(void) {
+    rand_state = rand_state * 1103515245 + 12345;
+    return (float) ((rand_state >> 8) & 0xffff) / 32768 - 1;
+}
+
+static inline int16_t
+clamp16(float value) {
+    if (value > 32767) {
+        return 32767;
+    }
+    if (value < -32768) {
+        return -32768;
+    }
+    return (int16_t) lrintf(value);
+}
+
+// two-pole resonator, a crude model of a formant
+struct resonator {
+    float a1, a2;
+    float y1, y2;
+};
+
+static void
+resonator_set(struct resonator *r, float freq, float bandwidth) {
+    float radius = expf(-M_PI * bandwidth / AUDIO_RATE);
+    r->a1 = 2 * radius * cosf(2 * M_PI * freq / AUDIO_RATE);
+    r->a2 = -radius * radius;
+}
+
+static float
+resonator_process(struct resonator *r, float x) {
+    float y = x + r->a1 * r->y1 + r->a2 * r->y2;
+    r->y2 = r->y1;
+    r->y1 = y;
+    return y;
+}
+
+// voiced syllables (glottal pulses through formants) separated by silences
+static void
+generate_speech(int16_t *samples, uint32_t frames) {
+    static const float formants[][2] = {
+        {730, 1090}, {270, 2290}, {530, 1840}, {300, 870}, {640, 1190},
+    };
+    struct resonator f1 = {0}, f2 = {0};
+    float phase = 0;
+    for (uint32_t i = 0; i < frames; ++i) {
+        uint32_t syllable = i / (AUDIO_RATE / 5);
+        uint32_t pos = i % (AUDIO_RATE / 5);
+        if (pos == 0) {
+            const float *f = formants[syllable % 5];
+            resonator_set(&f1, f[0], 80);
+            resonator_set(&f2, f[1], 120);
+        }
+        bool silence = syllable % 7 == 6;
+        float pitch = 120 + 40 * sinf(2 * M_PI * i / (3.f * AUDIO_RATE));
+        phase += pitch / AUDIO_RATE;
+        float excitation = 0;
+        if (phase >= 1) {
+            phase -= 1;
+            excitation = silence ? 0 : 3000;
+        }
+        float envelope = sinf(M_PI * pos / (AUDIO_RATE / 5));
+        float x = excitation * envelope + noise() * 20;
+        float y = resonator_process(&f1, x) * 0.6f
+                + resonator_process(&f2, x) * 0.4f;
+        samples[2 * i] = clamp16(y);
+        samples[2 * i + 1] = clamp16(y * 0.9f + noise() * 10);
+    }
+}
+
+// chords of decaying harmonic notes, panned across the stereo field
+static void
+generate_music(int16_t *samples, uint32_t frames) {
+    static const float notes[][3] = {
+        {261.63, 329.63, 392.00}, {220.00, 261.63, 329.63},
+        {174.61, 220.00, 261.63}, {196.00, 246.94, 293.66},
+    };
+    for (uint32_t i = 0; i < frames; ++i) {
+        uint32_t chord = i / (AUDIO_RATE / 2);
+        float t = (float) (i % (AUDIO_RATE / 2)) / AUDIO_RATE;
+        float decay = expf(-3 * t);
+        float left = 0;
+        float right = 0;
+        for (int n = 0; n < 3; ++n) {
+            float freq = notes[chord % 4][n];
+            float note = 0;
+            for (int h = 1; h <= 4; ++h) {
+                note += sinf(2 * M_PI * freq * h * i / AUDIO_RATE) / h;
+            }
+            float pan = (n + 1) / 4.f;
+            left += note * (1 - pan);
+            right += note * pan;
+        }
+        samples[2 * i] = clamp16(left * 4000 * decay + noise() * 30);
+        samples[2 * i + 1] = clamp16(right * 4000 * decay + noise() * 30);
+    }
+}
+
+static double
+elapsed_sec(uint64_t start) {
+    return (double) (audio_clock_now() - start) / NS_PER_SEC;
+}
+
+static size_t
+decode_all(const uint8_t *buf, size_t len, int16_t *samples) {
+    size_t frames = 0;
+    size_t pos = 0;
+    while (pos < len) {
+        uint32_t n;
+        ssize_t r = codec_decode_frame(&buf[pos], len - pos,
+                                       &samples[2 * frames], &n);
+        if (r <= 0) {
+            fprintf(stderr, "Could not decode frame at %zu\n", pos);
+            return 0;
+        }
+        pos += r;
+        frames += n;
+    }
+    return frames;
+}
+
+static bool
+bench(const char *name, void (*generate)(int16_t *, uint32_t)) {
+    uint32_t frames = DURATION_SEC * AUDIO_RATE;
+    size_t raw_size = frames * AUDIO_FRAME_SIZE;
+
+    int16_t *samples = malloc(raw_size);
+    // the decoder may write a whole frame past the end of the stream
+    int16_t *decoded = malloc(raw_size + CODEC_MAX_FRAMES * AUDIO_FRAME_SIZE);
+    uint8_t *encoded = malloc(codec_max_encoded_size(frames));
+    if (!samples || !decoded || !encoded) {
+        fprintf(stderr, "Could not allocate buffers\n");
+        return false;
+    }
+
+    generate(samples, frames);
+
+    bool ok = false;
+    size_t size = 0;
+    uint64_t start = audio_clock_now();
+    for (int i = 0; i < ITERATIONS; ++i) {
+        size = codec_encode(samples, frames, encoded);
+    }
+    double encode_sec = elapsed_sec(start);
+
+    size_t decoded_frames = 0;
+    start = audio_clock_now();
+    for (int i = 0; i < ITERATIONS; ++i) {
+        decoded_frames = decode_all(encoded, size, decoded);
+    }
+    double decode_sec = elapsed_sec(start);
+
+    if (decoded_frames != frames || memcmp(samples, decoded, raw_size)) {
+        fprintf(stderr, "%s: decoded samples do not match\n", name);
+        goto end;
+    }
+
+    // start decoding from the middle of a frame
+    size_t offset = size / 3;
+    offset += codec_find_sync(&encoded[offset], size - offset);
+    size_t skipped = 0;
+    for (;;) {
+        uint32_t n;
+        ssize_t r = codec_decode_frame(&encoded[offset], size - offset,
+                                       decoded, &n);
+        if (r > 0) {
+            break;
+        }
+        // not a real frame start, look for the next sync word
+        ++offset;
+        ++skipped;
+        offset += codec_find_sync(&encoded[offset], size - offset);
+    }
+    size_t resync_frames = decode_all(&encoded[offset], size - offset,
+                                      decoded);
+    if (!resync_frames || memcmp(&samples[2 * (frames - resync_frames)],
+                                 decoded, resync_frames * AUDIO_FRAME_SIZE)) {
+        fprintf(stderr, "%s: could not resync mid-stream\n", name);
+        goto end;
+    }
+
+    double mb = (double) raw_size * ITERATIONS / 1e6;
+    printf("%-8s ratio %5.1f%%  encode %7.1f MB/s  decode %7.1f MB/s  "
+           "(resync after %zu false syncs)\n", name,
+           100. * size / raw_size, mb / encode_sec, mb / decode_sec, skipped);
+    ok = true;
+
+end:
+    free(samples);
+    free(decoded);
+    free(encoded);
+    return ok;
+}
+
+int main(void) {
+    bool ok = bench("speech", generate_speech)
+           && bench("music", generate_music);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,31 @@
+#!/bin/sh
+# Measure the startup of "usbaudio -n", to compare the default build (the
+# backends are modules loaded on demand) with a single binary
+# (-Dmodular_backends=false).
+#
+# No device matches the serial, so usbaudio stops right after enumerating the
+# USB devices: only the startup is measured.
+set -e
+
+usbaudio="$1"
+runs="${2:-100}"
+config="${3:-unknown configuration}"
+serial=usbaudio-startup-benchmark
+
+start=$(date +%s%N)
+i=0
+while [ "$i" -lt "$runs" ]
+do
+    "$usbaudio" -n -s "$serial" >/dev/null 2>&1 || true
+    i=$((i + 1))
+done
+end=$(date +%s%N)
+echo "usbaudio -n ($config): $(( (end - start) / runs / 1000 ))us per run" \
+     "($runs runs)"
+
+objects=$(LD_DEBUG=libs "$usbaudio" -n -s "$serial" 2>&1 \
+              | grep -c 'calling init:' || true)
+echo "shared objects initialized: $objects"
+
+LD_DEBUG=statistics "$usbaudio" -n -s "$serial" 2>&1 \
+    | grep 'total startup time' | sed 's/^[[:space:]]*[0-9]*:[[:space:]]*//' || true
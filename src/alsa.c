@@ -0,0 +1,468 @@
+#define _GNU_SOURCE // for the ALSA headers
+#include "alsa.h"
+
+#include <alsa/asoundlib.h>
+#include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "plc.h"
+
+// small periods, so that each block is delivered as soon as possible
+#define ALSA_PERIOD_FRAMES 256 // ~5.8ms
+#define ALSA_PERIODS 4
+
+// the playback starts once this number of periods are buffered
+#define ALSA_PLAYBACK_START_PERIODS 2
+
+// capture device overriding the card of the USB device (for testing)
+static const char *alsa_capture_device;
+
+static void
+log_alsa_error(const char *msg, int err) {
+    LOGE("%s: %s", msg, snd_strerror(err));
+}
+
+static bool
+read_line(const char *path, char *data, size_t len) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return false;
+    }
+
+    bool ok = fgets(data, len, file);
+    fclose(file);
+    if (ok) {
+        data[strcspn(data, "\n")] = '\0';
+    }
+    return ok;
+}
+
+int
+alsa_find_card(const char *serial) {
+    if (alsa_capture_device) {
+        // the card is not used
+        return 0;
+    }
+
+    DIR *dir = opendir("/sys/class/sound");
+    if (!dir) {
+        LOGE("Could not list sound cards");
+        return -1;
+    }
+
+    int card = -1;
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        int nr;
+        int end;
+        if (sscanf(entry->d_name, "card%d%n", &nr, &end) != 1
+                || entry->d_name[end] != '\0') {
+            continue;
+        }
+
+        // "device" links to the USB interface, its parent is the USB device
+        char path[300];
+        snprintf(path, sizeof(path), "/sys/class/sound/%s/device/../serial",
+                 entry->d_name);
+
+        char card_serial[128];
+        if (!read_line(path, card_serial, sizeof(card_serial))) {
+            // not a USB sound card
+            continue;
+        }
+
+        LOGD("%s ? %s", serial, card_serial);
+        if (!strcmp(serial, card_serial)) {
+            card = nr;
+            LOGI("Matching ALSA card found: %d", card);
+            break;
+        }
+    }
+
+    closedir(dir);
+    return card;
+}
+
+static bool
+alsa_configure(snd_pcm_t *pcm, snd_pcm_access_t access,
+               snd_pcm_uframes_t start_threshold) {
+    snd_pcm_hw_params_t *hw_params;
+    int r = snd_pcm_hw_params_malloc(&hw_params);
+    if (r < 0) {
+        log_alsa_error("Could not allocate hw params", r);
+        return false;
+    }
+
+    bool ret = false;
+
+    unsigned rate = AUDIO_RATE;
+    snd_pcm_uframes_t period = ALSA_PERIOD_FRAMES;
+    unsigned periods = ALSA_PERIODS;
+    if ((r = snd_pcm_hw_params_any(pcm, hw_params)) < 0
+            || (r = snd_pcm_hw_params_set_access(pcm, hw_params, access)) < 0
+            || (r = snd_pcm_hw_params_set_format(pcm, hw_params,
+                                                 SND_PCM_FORMAT_S16_LE)) < 0
+            || (r = snd_pcm_hw_params_set_channels(pcm, hw_params,
+                                                   AUDIO_CHANNELS)) < 0
+            || (r = snd_pcm_hw_params_set_rate(pcm, hw_params, rate, 0)) < 0
+            || (r = snd_pcm_hw_params_set_period_size_near(pcm, hw_params,
+                                                           &period, 0)) < 0
+            || (r = snd_pcm_hw_params_set_periods_near(pcm, hw_params,
+                                                       &periods, 0)) < 0
+            || (r = snd_pcm_hw_params(pcm, hw_params)) < 0) {
+        log_alsa_error("Could not set hw params", r);
+        goto finally_free_hw_params;
+    }
+
+    snd_pcm_sw_params_t *sw_params;
+    r = snd_pcm_sw_params_malloc(&sw_params);
+    if (r < 0) {
+        log_alsa_error("Could not allocate sw params", r);
+        goto finally_free_hw_params;
+    }
+
+    if ((r = snd_pcm_sw_params_current(pcm, sw_params)) < 0
+            || (r = snd_pcm_sw_params_set_avail_min(pcm, sw_params,
+                                                    period)) < 0
+            || (r = snd_pcm_sw_params_set_start_threshold(pcm, sw_params,
+                                                start_threshold)) < 0
+            || (r = snd_pcm_sw_params(pcm, sw_params)) < 0) {
+        log_alsa_error("Could not set sw params", r);
+        goto finally_free_sw_params;
+    }
+
+    LOGI("ALSA %s: period %lu frames, buffer %u periods (%.1fms)",
+         snd_pcm_name(pcm), (unsigned long) period, periods,
+         1000. * period * periods / AUDIO_RATE);
+    ret = true;
+
+finally_free_sw_params:
+    snd_pcm_sw_params_free(sw_params);
+finally_free_hw_params:
+    snd_pcm_hw_params_free(hw_params);
+
+    return ret;
+}
+
+static inline void *
+area_ptr(const snd_pcm_channel_area_t *areas, snd_pcm_uframes_t offset) {
+    // interleaved: all the channels share the first area
+    return (uint8_t *) areas[0].addr
+         + (areas[0].first + offset * areas[0].step) / 8;
+}
+
+static bool
+alsa_set_capture_device(const char *device) {
+    alsa_capture_device = device;
+    return true;
+}
+
+static snd_pcm_t *
+alsa_open_capture(int card) {
+    char name[32];
+    snprintf(name, sizeof(name), "hw:%d,0", card);
+    const char *device = alsa_capture_device ? alsa_capture_device : name;
+
+    snd_pcm_t *pcm;
+    int r = snd_pcm_open(&pcm, device, SND_PCM_STREAM_CAPTURE,
+                         SND_PCM_NONBLOCK);
+    if (r < 0) {
+        log_alsa_error("Could not open ALSA capture device", r);
+        return NULL;
+    }
+
+    // the frames are read directly from the DMA buffer
+    if (!alsa_configure(pcm, SND_PCM_ACCESS_MMAP_INTERLEAVED, 1)) {
+        snd_pcm_close(pcm);
+        return NULL;
+    }
+
+    return pcm;
+}
+
+// deliver the available frames to cb, without copy
+//
+// return false if the capture must stop
+static bool
+alsa_read_available(snd_pcm_t *pcm, audio_block_cb cb, void *userdata,
+                    bool *error) {
+    snd_pcm_sframes_t avail;
+    snd_pcm_sframes_t delay;
+    int r = snd_pcm_avail_delay(pcm, &avail, &delay);
+    if (r < 0) {
+        // overrun
+        LOGW("ALSA capture: %s", snd_strerror(r));
+        if ((r = snd_pcm_recover(pcm, r, 1)) < 0
+                || (r = snd_pcm_start(pcm)) < 0) {
+            log_alsa_error("Could not recover ALSA capture", r);
+            *error = true;
+            return false;
+        }
+        return true;
+    }
+
+    // the delay is the number of frames captured but not read yet, so the
+    // next frame to read was captured delay frames ago
+    uint64_t pts = audio_clock_now() - audio_frames_to_ns(delay);
+
+    while (avail > 0) {
+        const snd_pcm_channel_area_t *areas;
+        snd_pcm_uframes_t offset;
+        snd_pcm_uframes_t frames = avail;
+        r = snd_pcm_mmap_begin(pcm, &areas, &offset, &frames);
+        if (r < 0) {
+            log_alsa_error("Could not access ALSA capture buffer", r);
+            *error = true;
+            return false;
+        }
+
+        struct audio_block block = {
+            .pts = pts,
+            .frames = frames,
+            .data = area_ptr(areas, offset),
+        };
+        bool cont = cb(&block, userdata);
+
+        snd_pcm_sframes_t committed = snd_pcm_mmap_commit(pcm, offset, frames);
+        if (committed < 0 || (snd_pcm_uframes_t) committed != frames) {
+            LOGW("ALSA capture: overrun during commit");
+        }
+
+        if (!cont) {
+            return false;
+        }
+
+        pts += audio_frames_to_ns(frames);
+        avail -= frames;
+    }
+
+    return true;
+}
+
+bool
+alsa_capture(int card, audio_block_cb cb, void *userdata) {
+    snd_pcm_t *pcm = alsa_open_capture(card);
+    if (!pcm) {
+        return false;
+    }
+
+    bool error = false;
+
+    int count = snd_pcm_poll_descriptors_count(pcm);
+    if (count <= 0) {
+        LOGE("Could not get ALSA poll descriptors");
+        error = true;
+        goto finally_close;
+    }
+
+    struct pollfd *fds = malloc(count * sizeof(*fds));
+    if (!fds) {
+        LOGE("Could not allocate poll descriptors");
+        error = true;
+        goto finally_close;
+    }
+
+    int r;
+    if ((r = snd_pcm_poll_descriptors(pcm, fds, count)) < 0
+            || (r = snd_pcm_start(pcm)) < 0) {
+        log_alsa_error("Could not start ALSA capture", r);
+        error = true;
+        goto finally_free_fds;
+    }
+
+    LOGI("Capturing ALSA device %s", snd_pcm_name(pcm));
+
+    for (;;) {
+        if (poll(fds, count, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOGE("Could not poll ALSA capture: %s", strerror(errno));
+            error = true;
+            break;
+        }
+
+        unsigned short revents;
+        snd_pcm_poll_descriptors_revents(pcm, fds, count, &revents);
+        if (!(revents & (POLLIN | POLLERR))) {
+            continue;
+        }
+
+        // on POLLERR, the xrun is reported by snd_pcm_avail_delay()
+        if (!alsa_read_available(pcm, cb, userdata, &error)) {
+            break;
+        }
+    }
+
+finally_free_fds:
+    free(fds);
+finally_close:
+    snd_pcm_close(pcm);
+
+    return !error;
+}
+
+struct alsa_playback {
+    snd_pcm_t *pcm;
+    bool mmap;
+    uint64_t dropped;
+};
+
+static bool
+alsa_open_playback(struct alsa_playback *playback, const char *device) {
+    if (!device) {
+        device = "default";
+    }
+
+    int r = snd_pcm_open(&playback->pcm, device, SND_PCM_STREAM_PLAYBACK,
+                         SND_PCM_NONBLOCK);
+    if (r < 0) {
+        log_alsa_error("Could not open ALSA playback device", r);
+        return false;
+    }
+
+    snd_pcm_uframes_t start = ALSA_PLAYBACK_START_PERIODS * ALSA_PERIOD_FRAMES;
+    playback->mmap = true;
+    playback->dropped = 0;
+    if (!alsa_configure(playback->pcm, SND_PCM_ACCESS_MMAP_INTERLEAVED,
+                        start)) {
+        // some plugins do not support mmap
+        LOGW("ALSA playback: mmap not available, fallback to read/write");
+        playback->mmap = false;
+        if (!alsa_configure(playback->pcm, SND_PCM_ACCESS_RW_INTERLEAVED,
+                            start)) {
+            snd_pcm_close(playback->pcm);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void
+alsa_drop_frames(struct alsa_playback *playback, snd_pcm_uframes_t frames) {
+    // the playback clock is slower than the capture clock
+    if (!playback->dropped) {
+        LOGW("ALSA playback: buffer full, dropping frames");
+    }
+    playback->dropped += frames;
+}
+
+static bool
+alsa_write(struct alsa_playback *playback, const int16_t *data,
+           snd_pcm_uframes_t frames) {
+    snd_pcm_t *pcm = playback->pcm;
+    while (frames) {
+        snd_pcm_uframes_t n = frames;
+        int r;
+        if (playback->mmap) {
+            snd_pcm_sframes_t avail = snd_pcm_avail_update(pcm);
+            if (avail < 0) {
+                r = avail;
+                goto recover;
+            }
+            if (!avail) {
+                alsa_drop_frames(playback, frames);
+                return true;
+            }
+            if (n > (snd_pcm_uframes_t) avail) {
+                n = avail;
+            }
+
+            const snd_pcm_channel_area_t *areas;
+            snd_pcm_uframes_t offset;
+            r = snd_pcm_mmap_begin(pcm, &areas, &offset, &n);
+            if (r < 0) {
+                goto recover;
+            }
+            memcpy(area_ptr(areas, offset), data, n * AUDIO_FRAME_SIZE);
+            snd_pcm_sframes_t committed = snd_pcm_mmap_commit(pcm, offset, n);
+            if (committed < 0) {
+                r = committed;
+                goto recover;
+            }
+            n = committed;
+        } else {
+            snd_pcm_sframes_t w = snd_pcm_writei(pcm, data, n);
+            if (w == -EAGAIN) {
+                alsa_drop_frames(playback, frames);
+                return true;
+            }
+            if (w < 0) {
+                r = w;
+                goto recover;
+            }
+            n = w;
+        }
+
+        data += n * AUDIO_CHANNELS;
+        frames -= n;
+        continue;
+
+recover:
+        // underrun, the playback restarts once the start threshold is
+        // reached again
+        LOGW("ALSA playback: %s", snd_strerror(r));
+        r = snd_pcm_recover(pcm, r, 1);
+        if (r < 0) {
+            log_alsa_error("Could not recover ALSA playback", r);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool
+alsa_playback_cb(const struct audio_block *block, void *userdata) {
+    struct alsa_playback *playback = userdata;
+    if (!block->data) {
+        // lost frames, not concealed
+        return true;
+    }
+    return alsa_write(playback, block->data, block->frames);
+}
+
+static bool
+alsa_play(int card, const struct play_params *params) {
+    struct alsa_playback playback;
+    if (!alsa_open_playback(&playback, params->device)) {
+        return false;
+    }
+
+    LOGI("Playing to ALSA device %s", snd_pcm_name(playback.pcm));
+
+    bool ok;
+    if (params->conceal) {
+        struct plc plc;
+        plc_init(&plc, alsa_playback_cb, &playback);
+        ok = alsa_capture(card, plc_block_cb, &plc);
+        plc_destroy(&plc);
+    } else {
+        ok = alsa_capture(card, alsa_playback_cb, &playback);
+    }
+    if (playback.dropped) {
+        LOGW("ALSA playback: %" PRIu64 " frames dropped", playback.dropped);
+    }
+
+    snd_pcm_close(playback.pcm);
+    return ok;
+}
+
+const struct backend alsa_backend = {
+    .name = "alsa",
+    .find_source = alsa_find_card,
+    .capture = alsa_capture,
+    .play = alsa_play,
+    .set_capture_device = alsa_set_capture_device,
+};
+
+#ifdef BACKEND_MODULE
+// entry point of the module, see backend_load()
+const struct backend *usbaudio_backend = &alsa_backend;
+#endif
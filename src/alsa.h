@@ -0,0 +1,24 @@
+#ifndef ALSA_H
+#define ALSA_H
+
+#include <stdbool.h>
+
+#include "audio.h"
+#include "backend.h"
+
+// Capture directly from the USB sound card of the device, without any sound
+// server, and play to an ALSA device (or capture to the output).
+extern const struct backend alsa_backend;
+
+// return the number of the ALSA card of the device, or -1 if not found (always
+// 0 if a capture device is set)
+int
+alsa_find_card(const char *serial);
+
+// capture the ALSA card until cb returns false
+//
+// return false on error
+bool
+alsa_capture(int card, audio_block_cb cb, void *userdata);
+
+#endif
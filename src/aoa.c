@@ -1,8 +1,10 @@
-#define _GNU_SOURCE // for strdup()
+#define _POSIX_C_SOURCE 200809L
 #include "aoa.h"
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/time.h>
 
 #include "config.h"
 #include "log.h"
@@ -49,29 +51,30 @@ control_transfer(libusb_device_handle *handle, control_params *params) {
     return true;
 }
 
-static bool
-get_serial(libusb_device *device, struct libusb_device_descriptor *desc,
-           char *data, int length) {
+bool
+aoa_read_serial(libusb_device *device, char *data, size_t length) {
+    struct libusb_device_descriptor desc;
+    libusb_get_device_descriptor(device, &desc);
+
+    if (!desc.iSerialNumber) {
+        LOGD("USB: device %04x:%04x has no serial number available",
+             desc.idVendor, desc.idProduct);
+        return false;
+    }
+
     libusb_device_handle *handle;
     int r = libusb_open(device, &handle);
     if (r) {
         LOGD("USB: cannot open device %04x:%04x (%s)",
-             desc->idVendor, desc->idProduct, libusb_strerror(r));
-        return false;
-    }
-
-    if (!desc->iSerialNumber) {
-        LOGD("USB: device %04x:%04x has no serial number available",
-             desc->idVendor, desc->idProduct);
-        libusb_close(handle);
+             desc.idVendor, desc.idProduct, libusb_strerror(r));
         return false;
     }
 
-    r = libusb_get_string_descriptor_ascii(handle, desc->iSerialNumber,
+    r = libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber,
                                            (unsigned char *) data, length);
     if (r <= 0) {
         LOGD("USB: cannot read serial of device %04x:%04x (%s)",
-             desc->idVendor, desc->idProduct, libusb_strerror(r));
+             desc.idVendor, desc.idProduct, libusb_strerror(r));
         libusb_close(handle);
         return false;
     }
@@ -82,12 +85,15 @@ get_serial(libusb_device *device, struct libusb_device_descriptor *desc,
     return true;
 }
 
-static bool
-has_adb(libusb_device *device, struct libusb_device_descriptor *desc) {
+bool
+aoa_has_adb(libusb_device *device) {
 #define ADB_CLASS 0xff
 #define ADB_SUBCLASS 0x42
 #define ADB_PROTOCOL 0x1
-    for (unsigned i = 0; i < desc->bNumConfigurations; ++i) {
+    struct libusb_device_descriptor desc;
+    libusb_get_device_descriptor(device, &desc);
+
+    for (unsigned i = 0; i < desc.bNumConfigurations; ++i) {
         struct libusb_config_descriptor *config;
         int r = libusb_get_config_descriptor(device, i, &config);
         if (r) {
@@ -116,72 +122,190 @@ has_adb(libusb_device *device, struct libusb_device_descriptor *desc) {
     return false;
 }
 
-ssize_t
-aoa_find_devices(const struct lookup *lookup,
-                 struct usb_device *devices, size_t len) {
-    size_t nr = 0; // number of devices found
+static bool
+get_path(libusb_device *device, char *path, size_t len) {
+    // same naming as sysfs: "bus-port.port..."
+    uint8_t ports[7]; // the USB specification limits the depth to 7
+    int n = libusb_get_port_numbers(device, ports, sizeof(ports));
+    if (n < 0) {
+        log_libusb_error(n);
+        return false;
+    }
+
+    size_t w = snprintf(path, len, "%u", libusb_get_bus_number(device));
+    for (int i = 0; i < n && w < len; ++i) {
+        w += snprintf(&path[w], len - w, "%c%u", i ? '.' : '-', ports[i]);
+    }
+    return w < len;
+}
+
+static void
+add_device(struct usb_registry *registry, libusb_device *device) {
+    char path[32];
+    if (!get_path(device, path, sizeof(path))) {
+        LOGE("Could not read device path");
+        return;
+    }
+
+    struct usb_device *existing = usb_registry_find_by_path(registry, path);
+    if (existing) {
+        if (existing->device == device) {
+            // already registered (enumerated and notified)
+            return;
+        }
+        // the departure of the previous device was missed
+        usb_registry_remove(registry, existing);
+    }
+
+    struct libusb_device_descriptor desc;
+    libusb_get_device_descriptor(device, &desc);
+
+    // the device is not opened here, its serial is read only if a lookup
+    // needs it (see usb_registry_get_serial())
+    struct usb_device *usb_device =
+        usb_registry_add(registry, device, desc.idVendor, desc.idProduct,
+                         path);
+    if (usb_device) {
+        LOGD("USB: device added: %s [%04x:%04x]", path, desc.idVendor,
+             desc.idProduct);
+    }
+}
+
+static void
+remove_device(struct usb_registry *registry, libusb_device *device) {
+    char path[32];
+    if (!get_path(device, path, sizeof(path))) {
+        LOGE("Could not read device path");
+        return;
+    }
+
+    struct usb_device *usb_device = usb_registry_find_by_path(registry, path);
+    if (usb_device && usb_device->device == device) {
+        LOGD("USB: device removed: %s", path);
+        usb_registry_remove(registry, usb_device);
+    }
+}
+
+static int
+hotplug_cb(libusb_context *ctx, libusb_device *device,
+           libusb_hotplug_event event, void *userdata) {
+    (void) ctx;
+    struct aoa_watcher *watcher = userdata;
+
+    // The devices must not be opened from the hotplug callback, so the
+    // events are queued and processed by aoa_update_devices().
+    if (watcher->pending_count == watcher->pending_cap) {
+        size_t cap = watcher->pending_cap ? watcher->pending_cap * 2 : 16;
+        struct aoa_event *pending =
+            realloc(watcher->pending, cap * sizeof(*pending));
+        if (!pending) {
+            LOGE("Could not queue hotplug event");
+            return 0;
+        }
+        watcher->pending = pending;
+        watcher->pending_cap = cap;
+    }
+
+    struct aoa_event *e = &watcher->pending[watcher->pending_count++];
+    e->device = libusb_ref_device(device);
+    e->arrived = event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED;
 
+    // keep the callback registered
+    return 0;
+}
+
+static void
+process_pending_events(struct aoa_watcher *watcher) {
+    for (size_t i = 0; i < watcher->pending_count; ++i) {
+        struct aoa_event *e = &watcher->pending[i];
+        if (e->arrived) {
+            add_device(watcher->registry, e->device);
+        } else {
+            remove_device(watcher->registry, e->device);
+        }
+        libusb_unref_device(e->device);
+    }
+    watcher->pending_count = 0;
+}
+
+static bool
+scan_devices(struct usb_registry *registry) {
     libusb_device **list;
     ssize_t cnt = libusb_get_device_list(NULL, &list);
     if (cnt < 0) {
         log_libusb_error(cnt);
-        return -1;
+        return false;
     }
 
-    for (ssize_t i = 0; i < cnt && nr < len; ++i) {
-        libusb_device *device = list[i];
+    for (ssize_t i = 0; i < cnt; ++i) {
+        add_device(registry, list[i]);
+    }
 
-        struct usb_device *usb_device = &devices[nr];
+    libusb_free_device_list(list, 1);
+    return true;
+}
 
-        struct libusb_device_descriptor desc;
-        libusb_get_device_descriptor(device, &desc);
+bool
+aoa_watch_devices(struct aoa_watcher *watcher,
+                  struct usb_registry *registry) {
+    watcher->registry = registry;
+    watcher->pending = NULL;
+    watcher->pending_count = 0;
+    watcher->pending_cap = 0;
+    watcher->hotplug = libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG);
+
+    if (!watcher->hotplug) {
+        LOGD("USB: hotplug not supported, scanning devices once");
+        return scan_devices(registry);
+    }
 
-        char serial[128];
-        bool match = false;
-        switch (lookup->type) {
-            case LOOKUP_BY_ADB_INTERFACE:
-                match = has_adb(device, &desc);
-                break;
-            case LOOKUP_BY_SERIAL: {
-                bool ok = get_serial(device, &desc, serial, sizeof(serial));
-                if (ok) {
-                    match = !strcmp(lookup->serial, serial);
-                }
-                break;
-            }
-            case LOOKUP_BY_VID_PID:
-                match = lookup->vid == desc.idVendor &&
-                        lookup->pid == desc.idProduct;
-                break;
-        }
+    // the already connected devices are notified during the registration
+    int r = libusb_hotplug_register_callback(NULL,
+            LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+                LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+            LIBUSB_HOTPLUG_ENUMERATE, LIBUSB_HOTPLUG_MATCH_ANY,
+            LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY, hotplug_cb,
+            watcher, &watcher->handle);
+    if (r) {
+        log_libusb_error(r);
+        free(watcher->pending);
+        return false;
+    }
 
-        if (match) {
-            // add the device to the result list
-            if (lookup->type != LOOKUP_BY_SERIAL) {
-                bool ok = get_serial(device, &desc, serial, sizeof(serial));
-                if (!ok) {
-                    LOGE("Could not read device serial");
-                    continue;
-                }
-            }
+    process_pending_events(watcher);
+    return true;
+}
 
-            usb_device->serial = strdup(serial);
-            usb_device->vid = desc.idVendor;
-            usb_device->pid = desc.idProduct;
-            usb_device->device = device;
-            libusb_ref_device(usb_device->device);
-            nr++;
+void
+aoa_unwatch_devices(struct aoa_watcher *watcher) {
+    if (watcher->hotplug) {
+        libusb_hotplug_deregister_callback(NULL, watcher->handle);
+        // drop the events received in the meantime
+        for (size_t i = 0; i < watcher->pending_count; ++i) {
+            libusb_unref_device(watcher->pending[i].device);
         }
     }
+    free(watcher->pending);
+}
 
-    libusb_free_device_list(list, 1);
+bool
+aoa_update_devices(struct aoa_watcher *watcher, unsigned timeout_ms) {
+    if (!watcher->hotplug) {
+        return true;
+    }
 
-    return nr;
-}
+    struct timeval tv = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_usec = (timeout_ms % 1000) * 1000,
+    };
+    int r = libusb_handle_events_timeout_completed(NULL, &tv, NULL);
+    if (r) {
+        log_libusb_error(r);
+        return false;
+    }
 
-void aoa_destroy_device(struct usb_device *usb_device) {
-    free(usb_device->serial);
-    libusb_unref_device(usb_device->device);
+    process_pending_events(watcher);
+    return true;
 }
 
 static bool
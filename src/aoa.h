@@ -3,33 +3,25 @@
 
 #include <inttypes.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <libusb-1.0/libusb.h>
 
-enum lookup_type {
-    // devices supporting adb
-    LOOKUP_BY_ADB_INTERFACE,
-    // devices having the provided serial
-    LOOKUP_BY_SERIAL,
-    // devices having the provided vid:pid
-    LOOKUP_BY_VID_PID,
-};
+#include "registry.h"
 
-struct lookup {
-    enum lookup_type type;
-    union {
-        const char *serial;
-        struct {
-            uint16_t vid;
-            uint16_t pid;
-        };
-    };
+struct aoa_event {
+    libusb_device *device;
+    bool arrived; // false if left
 };
 
-struct usb_device {
-    uint16_t vid;
-    uint16_t pid;
-    char *serial;
-    libusb_device *device;
+// keep a registry up-to-date with the connected devices
+struct aoa_watcher {
+    struct usb_registry *registry;
+    bool hotplug;
+    libusb_hotplug_callback_handle handle;
+    // hotplug events not processed yet
+    struct aoa_event *pending;
+    size_t pending_count;
+    size_t pending_cap;
 };
 
 bool
@@ -38,15 +30,28 @@ aoa_init(void);
 void
 aoa_exit(void);
 
-ssize_t
-aoa_find_devices(const struct lookup *lookup,
-                 struct usb_device *devices, size_t len);
-
+// register the connected devices, then track their arrival and departure
+// (if hotplug is supported)
 bool
-aoa_forward_audio(const struct usb_device *device);
+aoa_watch_devices(struct aoa_watcher *watcher, struct usb_registry *registry);
 
 void
-aoa_destroy_device(struct usb_device *device);
+aoa_unwatch_devices(struct aoa_watcher *watcher);
+
+// process the hotplug events, waiting at most timeout_ms for new events
+bool
+aoa_update_devices(struct aoa_watcher *watcher, unsigned timeout_ms);
+
+// to be used as the usb_serial_reader of the registry (the device is opened)
+bool
+aoa_read_serial(libusb_device *device, char *serial, size_t len);
+
+// to be used as the usb_adb_checker of the registry
+bool
+aoa_has_adb(libusb_device *device);
+
+bool
+aoa_forward_audio(const struct usb_device *device);
 
 // there is no function to disable forwarding, because it just does not work
 // you need to unplug the device
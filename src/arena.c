@@ -0,0 +1,59 @@
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_CHUNK_SIZE 4096
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+void
+arena_init(struct arena *arena) {
+    arena->head = NULL;
+}
+
+void
+arena_destroy(struct arena *arena) {
+    struct arena_chunk *chunk = arena->head;
+    while (chunk) {
+        struct arena_chunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->head = NULL;
+}
+
+static void *
+arena_alloc(struct arena *arena, size_t len) {
+    struct arena_chunk *chunk = arena->head;
+    if (!chunk || chunk->size - chunk->used < len) {
+        size_t size = len > ARENA_CHUNK_SIZE ? len : ARENA_CHUNK_SIZE;
+        chunk = malloc(sizeof(*chunk) + size);
+        if (!chunk) {
+            return NULL;
+        }
+        chunk->next = arena->head;
+        chunk->size = size;
+        chunk->used = 0;
+        arena->head = chunk;
+    }
+
+    void *ptr = &chunk->data[chunk->used];
+    chunk->used += len;
+    return ptr;
+}
+
+char *
+arena_strdup(struct arena *arena, const char *s) {
+    size_t len = strlen(s) + 1;
+    char *dup = arena_alloc(arena, len);
+    if (dup) {
+        memcpy(dup, s, len);
+    }
+    return dup;
+}
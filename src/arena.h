@@ -0,0 +1,24 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// Bump allocator for small strings which live as long as their owner.
+//
+// Individual allocations are never freed, everything is released at once by
+// arena_destroy().
+struct arena {
+    struct arena_chunk *head;
+};
+
+void
+arena_init(struct arena *arena);
+
+void
+arena_destroy(struct arena *arena);
+
+// return NULL on allocation failure
+char *
+arena_strdup(struct arena *arena, const char *s);
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef AUDIO_H
+#define AUDIO_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <time.h>
+
+// AOA only supports one format: AUDIO_MODE_S16LSB_STEREO_44100HZ
+// <https://source.android.com/devices/accessories/aoa2#audio-support>
+#define AUDIO_RATE 44100
+#define AUDIO_CHANNELS 2
+#define AUDIO_FRAME_SIZE (AUDIO_CHANNELS * sizeof(int16_t))
+
+#define NS_PER_SEC 1000000000ull
+
+struct audio_block {
+    // CLOCK_MONOTONIC time (in ns) at which the first frame was captured,
+    // compensated for the capture latency
+    uint64_t pts;
+    // number of frames (1 frame = AUDIO_CHANNELS samples)
+    uint32_t frames;
+    // interleaved S16LE samples, or NULL if the frames were lost by the
+    // capture (a hole reported by the backend)
+    const int16_t *data;
+    // the frames were (partially) synthesized by the packet loss concealment
+    bool concealed;
+};
+
+// return false to stop the capture
+typedef bool (*audio_block_cb)(const struct audio_block *block,
+                               void *userdata);
+
+// the clock shared by all the capture backends and exported in the streams
+static inline uint64_t
+audio_clock_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+static inline uint64_t
+audio_frames_to_ns(uint64_t frames) {
+    return frames * NS_PER_SEC / AUDIO_RATE;
+}
+
+static inline uint64_t
+audio_ns_to_frames(uint64_t ns) {
+    return ns * AUDIO_RATE / NS_PER_SEC;
+}
+
+#endif
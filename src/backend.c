@@ -0,0 +1,118 @@
+#define _POSIX_C_SOURCE 200809L
+#include "backend.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#include "config.h"
+#include "log.h"
+
+#ifdef BACKEND_MODULES
+# include <dlfcn.h>
+# include <stdio.h>
+# include <stdlib.h>
+#else
+# include "pulse.h"
+# ifdef HAVE_ALSA
+#  include "alsa.h"
+# endif
+# ifdef HAVE_PIPEWIRE
+#  include "pipewire.h"
+# endif
+#endif
+
+static const char *const names[] = {
+    // the first one is the default
+    "pulse",
+#ifdef HAVE_ALSA
+    "alsa",
+#endif
+#ifdef HAVE_PIPEWIRE
+    "pipewire",
+#endif
+};
+
+#ifndef BACKEND_MODULES
+// same order as names
+static const struct backend *const backends[] = {
+    &pulse_backend,
+# ifdef HAVE_ALSA
+    &alsa_backend,
+# endif
+# ifdef HAVE_PIPEWIRE
+    &pipewire_backend,
+# endif
+};
+#endif
+
+static int
+backend_index(const char *name) {
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+        if (!strcmp(names[i], name)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+bool
+backend_exists(const char *name) {
+    return backend_index(name) != -1;
+}
+
+#ifdef BACKEND_MODULES
+static const struct backend *
+backend_load_module(const char *name) {
+    // the modules may be run from the build directory
+    const char *dir = getenv("USBAUDIO_MODULE_DIR");
+    if (!dir) {
+        dir = MODULE_DIR;
+    }
+
+    char path[256];
+    snprintf(path, sizeof(path), "%s/usbaudio-%s.so", dir, name);
+
+    // never closed, the backend is used until the end of the process
+    void *module = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!module) {
+        LOGE("Could not load backend module: %s", dlerror());
+        return NULL;
+    }
+
+    const struct backend *const *backend =
+        dlsym(module, BACKEND_MODULE_SYMBOL);
+    if (!backend) {
+        LOGE("Could not find backend in module: %s", dlerror());
+        dlclose(module);
+        return NULL;
+    }
+
+    return *backend;
+}
+#endif
+
+const struct backend *
+backend_load(const char *name) {
+    int index = backend_index(name);
+    if (index == -1) {
+        return NULL;
+    }
+
+#ifdef BACKEND_MODULES
+    return backend_load_module(name);
+#else
+    return backends[index];
+#endif
+}
+
+const char *
+backend_names(void) {
+    return "pulse"
+#ifdef HAVE_ALSA
+           ", alsa"
+#endif
+#ifdef HAVE_PIPEWIRE
+           ", pipewire"
+#endif
+           ;
+}
@@ -0,0 +1,52 @@
+#ifndef BACKEND_H
+#define BACKEND_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include "audio.h"
+
+struct play_params {
+    // target latency of the playback buffer (in ms, pulse)
+    uint32_t live_caching;
+    // playback device (NULL for the default one)
+    const char *device;
+    // conceal the lost frames, for the backends playing the captured frames
+    // (alsa, pulse; the pipewire loopback plays them inside the graph)
+    bool conceal;
+};
+
+// audio system exposing the input source of the device
+struct backend {
+    const char *name;
+    // return the identifier (>= 0) of the input source matching the device
+    // serial, or -1 if not found (yet)
+    int (*find_source)(const char *serial);
+    // capture the input source until cb returns false
+    bool (*capture)(int source, audio_block_cb cb, void *userdata);
+    // play the input source locally, until the device is unplugged
+    bool (*play)(int source, const struct play_params *params);
+    // optional (NULL if not supported): capture from this device instead of
+    // the input source of the USB device, e.g. a loopback device for testing
+    bool (*set_capture_device)(const char *device);
+};
+
+// The backends are built as modules (unless the meson option
+// "modular_backends" is disabled), so that their dependencies are loaded only
+// when they are used. Each module exports a pointer to its backend:
+//
+//     const struct backend *usbaudio_backend = &my_backend;
+#define BACKEND_MODULE_SYMBOL "usbaudio_backend"
+
+bool
+backend_exists(const char *name);
+
+// return NULL on error
+const struct backend *
+backend_load(const char *name);
+
+// list of the available backend names, for the usage
+const char *
+backend_names(void);
+
+#endif
@@ -0,0 +1,631 @@
+#include "codec.h"
+
+#include <assert.h>
+#include <stdbool.h>
+
+#define SYNC0 0xFF
+#define SYNC1 0xF5
+
+#define HEADER_SIZE 4
+#define CRC_SIZE 2
+
+#define MAX_ORDER 3
+#define SUBFRAME_VERBATIM 4
+#define SUBFRAME_TYPE_BITS 3
+#define STEREO_MODE_BITS 2
+#define RICE_PARAM_BITS 5
+#define MAX_RICE_PARAM 30
+
+#define MAX_PARTITIONS \
+    ((CODEC_MAX_FRAMES + CODEC_PARTITION_SIZE - 1) / CODEC_PARTITION_SIZE)
+
+enum stereo_mode {
+    STEREO_LEFT_RIGHT,
+    STEREO_LEFT_SIDE,
+    STEREO_SIDE_RIGHT,
+    STEREO_MID_SIDE,
+};
+
+// index of the channels computed by the encoder
+enum channel {
+    CHANNEL_LEFT,
+    CHANNEL_RIGHT,
+    CHANNEL_MID,
+    CHANNEL_SIDE,
+};
+
+// CRC-16, polynomial x^16 + x^15 + x^2 + 1 (0x8005)
+static const uint16_t crc16_table[256] = {
+    0x0000, 0x8005, 0x800f, 0x000a, 0x801b, 0x001e, 0x0014, 0x8011,
+    0x8033, 0x0036, 0x003c, 0x8039, 0x0028, 0x802d, 0x8027, 0x0022,
+    0x8063, 0x0066, 0x006c, 0x8069, 0x0078, 0x807d, 0x8077, 0x0072,
+    0x0050, 0x8055, 0x805f, 0x005a, 0x804b, 0x004e, 0x0044, 0x8041,
+    0x80c3, 0x00c6, 0x00cc, 0x80c9, 0x00d8, 0x80dd, 0x80d7, 0x00d2,
+    0x00f0, 0x80f5, 0x80ff, 0x00fa, 0x80eb, 0x00ee, 0x00e4, 0x80e1,
+    0x00a0, 0x80a5, 0x80af, 0x00aa, 0x80bb, 0x00be, 0x00b4, 0x80b1,
+    0x8093, 0x0096, 0x009c, 0x8099, 0x0088, 0x808d, 0x8087, 0x0082,
+    0x8183, 0x0186, 0x018c, 0x8189, 0x0198, 0x819d, 0x8197, 0x0192,
+    0x01b0, 0x81b5, 0x81bf, 0x01ba, 0x81ab, 0x01ae, 0x01a4, 0x81a1,
+    0x01e0, 0x81e5, 0x81ef, 0x01ea, 0x81fb, 0x01fe, 0x01f4, 0x81f1,
+    0x81d3, 0x01d6, 0x01dc, 0x81d9, 0x01c8, 0x81cd, 0x81c7, 0x01c2,
+    0x0140, 0x8145, 0x814f, 0x014a, 0x815b, 0x015e, 0x0154, 0x8151,
+    0x8173, 0x0176, 0x017c, 0x8179, 0x0168, 0x816d, 0x8167, 0x0162,
+    0x8123, 0x0126, 0x012c, 0x8129, 0x0138, 0x813d, 0x8137, 0x0132,
+    0x0110, 0x8115, 0x811f, 0x011a, 0x810b, 0x010e, 0x0104, 0x8101,
+    0x8303, 0x0306, 0x030c, 0x8309, 0x0318, 0x831d, 0x8317, 0x0312,
+    0x0330, 0x8335, 0x833f, 0x033a, 0x832b, 0x032e, 0x0324, 0x8321,
+    0x0360, 0x8365, 0x836f, 0x036a, 0x837b, 0x037e, 0x0374, 0x8371,
+    0x8353, 0x0356, 0x035c, 0x8359, 0x0348, 0x834d, 0x8347, 0x0342,
+    0x03c0, 0x83c5, 0x83cf, 0x03ca, 0x83db, 0x03de, 0x03d4, 0x83d1,
+    0x83f3, 0x03f6, 0x03fc, 0x83f9, 0x03e8, 0x83ed, 0x83e7, 0x03e2,
+    0x83a3, 0x03a6, 0x03ac, 0x83a9, 0x03b8, 0x83bd, 0x83b7, 0x03b2,
+    0x0390, 0x8395, 0x839f, 0x039a, 0x838b, 0x038e, 0x0384, 0x8381,
+    0x0280, 0x8285, 0x828f, 0x028a, 0x829b, 0x029e, 0x0294, 0x8291,
+    0x82b3, 0x02b6, 0x02bc, 0x82b9, 0x02a8, 0x82ad, 0x82a7, 0x02a2,
+    0x82e3, 0x02e6, 0x02ec, 0x82e9, 0x02f8, 0x82fd, 0x82f7, 0x02f2,
+    0x02d0, 0x82d5, 0x82df, 0x02da, 0x82cb, 0x02ce, 0x02c4, 0x82c1,
+    0x8243, 0x0246, 0x024c, 0x8249, 0x0258, 0x825d, 0x8257, 0x0252,
+    0x0270, 0x8275, 0x827f, 0x027a, 0x826b, 0x026e, 0x0264, 0x8261,
+    0x0220, 0x8225, 0x822f, 0x022a, 0x823b, 0x023e, 0x0234, 0x8231,
+    0x8213, 0x0216, 0x021c, 0x8219, 0x0208, 0x820d, 0x8207, 0x0202,
+};
+
+static uint16_t
+crc16(const uint8_t *data, size_t len) {
+    uint16_t crc = 0;
+    for (size_t i = 0; i < len; ++i) {
+        crc = (crc << 8) ^ crc16_table[(crc >> 8) ^ data[i]];
+    }
+    return crc;
+}
+
+static inline uint32_t
+zigzag_encode(int32_t value) {
+    return ((uint32_t) value << 1) ^ (uint32_t) (value >> 31);
+}
+
+static inline int32_t
+zigzag_decode(uint32_t value) {
+    return (int32_t) (value >> 1) ^ -(int32_t) (value & 1);
+}
+
+static inline int32_t
+sign_extend(uint32_t value, unsigned bits) {
+    uint32_t sign = UINT32_C(1) << (bits - 1);
+    return (int32_t) ((value ^ sign) - sign);
+}
+
+static inline unsigned
+channel_bits(enum channel channel) {
+    // the side channel requires one more bit
+    return channel == CHANNEL_SIDE ? 17 : 16;
+}
+
+struct bitwriter {
+    uint8_t *buf;
+    size_t pos;
+    uint64_t acc;
+    unsigned bits; // number of pending bits in acc (less than 8)
+};
+
+static inline void
+bw_put(struct bitwriter *bw, uint32_t value, unsigned n) {
+    assert(n <= 32);
+    bw->acc = (bw->acc << n) | (value & ((UINT64_C(1) << n) - 1));
+    bw->bits += n;
+    while (bw->bits >= 8) {
+        bw->bits -= 8;
+        bw->buf[bw->pos++] = (uint8_t) (bw->acc >> bw->bits);
+    }
+}
+
+static inline void
+bw_put_rice(struct bitwriter *bw, uint32_t value, unsigned k) {
+    uint32_t q = value >> k;
+    uint32_t low = value & ((UINT32_C(1) << k) - 1);
+    if (q + 1 + k <= 32) {
+        // common case: write the unary and binary parts at once
+        bw_put(bw, (UINT32_C(1) << k) | low, q + 1 + k);
+        return;
+    }
+    while (q >= 32) {
+        bw_put(bw, 0, 32);
+        q -= 32;
+    }
+    bw_put(bw, 1, q + 1);
+    bw_put(bw, low, k);
+}
+
+static inline void
+bw_align(struct bitwriter *bw) {
+    if (bw->bits) {
+        bw_put(bw, 0, 8 - bw->bits);
+    }
+}
+
+struct bitreader {
+    const uint8_t *buf;
+    size_t len;
+    size_t pos;
+    uint64_t acc; // left-aligned
+    unsigned bits; // number of valid bits in acc
+    bool overrun;
+};
+
+static inline void
+br_refill(struct bitreader *br) {
+    while (br->bits <= 56 && br->pos < br->len) {
+        br->acc |= (uint64_t) br->buf[br->pos++] << (56 - br->bits);
+        br->bits += 8;
+    }
+}
+
+static inline uint32_t
+br_get(struct bitreader *br, unsigned n) {
+    assert(n && n <= 32);
+    if (br->bits < n) {
+        br_refill(br);
+        if (br->bits < n) {
+            br->overrun = true;
+            return 0;
+        }
+    }
+    uint32_t value = br->acc >> (64 - n);
+    br->acc <<= n;
+    br->bits -= n;
+    return value;
+}
+
+static inline uint32_t
+br_get_unary(struct bitreader *br) {
+    uint32_t q = 0;
+    for (;;) {
+        br_refill(br);
+        if (!br->bits) {
+            br->overrun = true;
+            return 0;
+        }
+        if (br->acc) {
+            // the bits after the valid ones are 0, so the first 1 is valid
+            unsigned zeros = __builtin_clzll(br->acc);
+            q += zeros;
+            br->acc = zeros == 63 ? 0 : br->acc << (zeros + 1);
+            br->bits -= zeros + 1;
+            return q;
+        }
+        q += br->bits;
+        br->bits = 0;
+    }
+}
+
+static inline uint32_t
+br_get_rice(struct bitreader *br, unsigned k) {
+    uint32_t q = br_get_unary(br);
+    uint32_t low = k ? br_get(br, k) : 0;
+    return (q << k) | low;
+}
+
+static inline size_t
+br_consumed(const struct bitreader *br) {
+    // number of bytes, including the partially read one
+    return br->pos - br->bits / 8;
+}
+
+// Compute the residuals of the fixed predictor of the given order into
+// residual[order..n).
+//
+// These loops have no dependency between iterations, so that the compiler
+// vectorizes them.
+static void
+compute_residual(const int32_t *restrict x, uint32_t n, unsigned order,
+                 int32_t *restrict residual) {
+    switch (order) {
+        case 0:
+            for (uint32_t i = 0; i < n; ++i) {
+                residual[i] = x[i];
+            }
+            break;
+        case 1:
+            for (uint32_t i = 1; i < n; ++i) {
+                residual[i] = x[i] - x[i - 1];
+            }
+            break;
+        case 2:
+            for (uint32_t i = 2; i < n; ++i) {
+                residual[i] = x[i] - 2 * x[i - 1] + x[i - 2];
+            }
+            break;
+        case 3:
+            for (uint32_t i = 3; i < n; ++i) {
+                residual[i] = x[i] - 3 * x[i - 1] + 3 * x[i - 2] - x[i - 3];
+            }
+            break;
+        default:
+            assert(!"invalid order");
+    }
+}
+
+static inline uint32_t
+abs32(int32_t value) {
+    return value < 0 ? -(uint32_t) value : (uint32_t) value;
+}
+
+// select the order of the fixed predictor minimizing the sum of the absolute
+// values of the residuals (computed in a single vectorizable pass)
+static unsigned
+select_order(const int32_t *restrict x, uint32_t n) {
+    if (n <= MAX_ORDER) {
+        return 0;
+    }
+
+    // |residual| < 2^20 and n <= 2^11, so the sums fit in 32 bits
+    uint32_t sum0 = 0;
+    uint32_t sum1 = 0;
+    uint32_t sum2 = 0;
+    uint32_t sum3 = 0;
+    for (uint32_t i = MAX_ORDER; i < n; ++i) {
+        int32_t e0 = x[i];
+        int32_t e1 = x[i] - x[i - 1];
+        int32_t e2 = e1 - (x[i - 1] - x[i - 2]);
+        int32_t e3 = e2 - (x[i - 1] - 2 * x[i - 2] + x[i - 3]);
+        sum0 += abs32(e0);
+        sum1 += abs32(e1);
+        sum2 += abs32(e2);
+        sum3 += abs32(e3);
+    }
+
+    unsigned order = 0;
+    uint32_t min = sum0;
+    if (sum1 < min) {
+        order = 1;
+        min = sum1;
+    }
+    if (sum2 < min) {
+        order = 2;
+        min = sum2;
+    }
+    if (sum3 < min) {
+        order = 3;
+    }
+    return order;
+}
+
+static unsigned
+select_rice_param(uint64_t sum, uint32_t n) {
+    // k ~ log2(mean)
+    unsigned k = 0;
+    while (k < MAX_RICE_PARAM && ((uint64_t) n << (k + 1)) < sum) {
+        ++k;
+    }
+    return k;
+}
+
+struct subframe {
+    unsigned type; // fixed predictor order or SUBFRAME_VERBATIM
+    unsigned rice_params[MAX_PARTITIONS];
+    uint64_t bits; // encoded size
+};
+
+static inline uint32_t
+partition_start(uint32_t p, unsigned order) {
+    // the first partition does not contain the warm-up samples
+    return p ? p * CODEC_PARTITION_SIZE : order;
+}
+
+static inline uint32_t
+partition_end(uint32_t p, uint32_t n) {
+    uint32_t end = (p + 1) * CODEC_PARTITION_SIZE;
+    return end < n ? end : n;
+}
+
+static inline uint32_t
+partition_count(uint32_t n) {
+    return (n + CODEC_PARTITION_SIZE - 1) / CODEC_PARTITION_SIZE;
+}
+
+static void
+analyze_subframe(const int32_t *restrict x, uint32_t n, unsigned width,
+                 int32_t *restrict residual, struct subframe *subframe) {
+    unsigned order = select_order(x, n);
+    compute_residual(x, n, order, residual);
+
+    uint64_t bits = SUBFRAME_TYPE_BITS + order * width;
+    uint32_t partitions = partition_count(n);
+    for (uint32_t p = 0; p < partitions; ++p) {
+        uint32_t start = partition_start(p, order);
+        uint32_t end = partition_end(p, n);
+
+        uint64_t sum = 0;
+        for (uint32_t i = start; i < end; ++i) {
+            sum += zigzag_encode(residual[i]);
+        }
+        unsigned k = select_rice_param(sum, end - start);
+
+        uint64_t high = 0;
+        for (uint32_t i = start; i < end; ++i) {
+            high += zigzag_encode(residual[i]) >> k;
+        }
+
+        subframe->rice_params[p] = k;
+        bits += RICE_PARAM_BITS + (uint64_t) (end - start) * (k + 1) + high;
+    }
+
+    uint64_t verbatim_bits = SUBFRAME_TYPE_BITS + (uint64_t) n * width;
+    if (bits < verbatim_bits) {
+        subframe->type = order;
+        subframe->bits = bits;
+    } else {
+        subframe->type = SUBFRAME_VERBATIM;
+        subframe->bits = verbatim_bits;
+    }
+}
+
+static void
+write_subframe(struct bitwriter *bw, const int32_t *x, uint32_t n,
+               unsigned width, const int32_t *residual,
+               const struct subframe *subframe) {
+    bw_put(bw, subframe->type, SUBFRAME_TYPE_BITS);
+
+    if (subframe->type == SUBFRAME_VERBATIM) {
+        for (uint32_t i = 0; i < n; ++i) {
+            bw_put(bw, (uint32_t) x[i], width);
+        }
+        return;
+    }
+
+    unsigned order = subframe->type;
+    for (unsigned i = 0; i < order; ++i) {
+        bw_put(bw, (uint32_t) x[i], width);
+    }
+
+    uint32_t partitions = partition_count(n);
+    for (uint32_t p = 0; p < partitions; ++p) {
+        unsigned k = subframe->rice_params[p];
+        bw_put(bw, k, RICE_PARAM_BITS);
+        uint32_t end = partition_end(p, n);
+        for (uint32_t i = partition_start(p, order); i < end; ++i) {
+            bw_put_rice(bw, zigzag_encode(residual[i]), k);
+        }
+    }
+}
+
+static size_t
+encode_frame(const int16_t *samples, uint32_t n, uint8_t *out) {
+    assert(n && n <= CODEC_MAX_FRAMES);
+
+    int32_t channels[4][CODEC_MAX_FRAMES];
+    int32_t residuals[4][CODEC_MAX_FRAMES];
+    struct subframe subframes[4];
+
+    for (uint32_t i = 0; i < n; ++i) {
+        int32_t left = samples[2 * i];
+        int32_t right = samples[2 * i + 1];
+        channels[CHANNEL_LEFT][i] = left;
+        channels[CHANNEL_RIGHT][i] = right;
+        channels[CHANNEL_MID][i] = (left + right) >> 1;
+        channels[CHANNEL_SIDE][i] = left - right;
+    }
+
+    for (int c = 0; c < 4; ++c) {
+        analyze_subframe(channels[c], n, channel_bits(c), residuals[c],
+                         &subframes[c]);
+    }
+
+    static const enum channel modes[4][2] = {
+        [STEREO_LEFT_RIGHT] = { CHANNEL_LEFT, CHANNEL_RIGHT },
+        [STEREO_LEFT_SIDE] = { CHANNEL_LEFT, CHANNEL_SIDE },
+        [STEREO_SIDE_RIGHT] = { CHANNEL_SIDE, CHANNEL_RIGHT },
+        [STEREO_MID_SIDE] = { CHANNEL_MID, CHANNEL_SIDE },
+    };
+
+    enum stereo_mode mode = STEREO_LEFT_RIGHT;
+    uint64_t min_bits = UINT64_MAX;
+    for (int m = 0; m < 4; ++m) {
+        uint64_t bits = subframes[modes[m][0]].bits
+                      + subframes[modes[m][1]].bits;
+        if (bits < min_bits) {
+            mode = m;
+            min_bits = bits;
+        }
+    }
+
+    out[0] = SYNC0;
+    out[1] = SYNC1;
+    out[2] = n & 0xff;
+    out[3] = n >> 8;
+
+    struct bitwriter bw = {
+        .buf = &out[HEADER_SIZE],
+        .pos = 0,
+        .acc = 0,
+        .bits = 0,
+    };
+    bw_put(&bw, mode, STEREO_MODE_BITS);
+    for (int i = 0; i < 2; ++i) {
+        enum channel c = modes[mode][i];
+        write_subframe(&bw, channels[c], n, channel_bits(c), residuals[c],
+                       &subframes[c]);
+    }
+    bw_align(&bw);
+
+    size_t size = HEADER_SIZE + bw.pos;
+    uint16_t crc = crc16(out, size);
+    out[size] = crc & 0xff;
+    out[size + 1] = crc >> 8;
+
+    return size + CRC_SIZE;
+}
+
+size_t
+codec_max_encoded_size(uint32_t frames) {
+    size_t count = (frames + CODEC_MAX_FRAMES - 1) / CODEC_MAX_FRAMES;
+    // a subframe is never larger than the verbatim encoding (17 bits per
+    // sample at most), plus the stereo mode, the subframe types and the
+    // padding
+    return count * (HEADER_SIZE + CRC_SIZE + 2)
+         + (2 * 17 * (size_t) frames + 7) / 8;
+}
+
+size_t
+codec_encode(const int16_t *samples, uint32_t frames, uint8_t *out) {
+    size_t size = 0;
+    while (frames) {
+        uint32_t n = frames < CODEC_MAX_FRAMES ? frames : CODEC_MAX_FRAMES;
+        size += encode_frame(samples, n, &out[size]);
+        samples += 2 * n;
+        frames -= n;
+    }
+    return size;
+}
+
+size_t
+codec_find_sync(const uint8_t *buf, size_t len) {
+    for (size_t i = 0; i < len; ++i) {
+        if (buf[i] == SYNC0 && (i + 1 == len || buf[i + 1] == SYNC1)) {
+            return i;
+        }
+    }
+    return len;
+}
+
+// read the subframe into x[0..n), return false if it is invalid
+static bool
+read_subframe(struct bitreader *br, int32_t *x, uint32_t n, unsigned width) {
+    unsigned type = br_get(br, SUBFRAME_TYPE_BITS);
+    if (type == SUBFRAME_VERBATIM) {
+        for (uint32_t i = 0; i < n; ++i) {
+            x[i] = sign_extend(br_get(br, width), width);
+        }
+        return true;
+    }
+
+    if (type > MAX_ORDER || type >= n) {
+        return false;
+    }
+
+    unsigned order = type;
+    for (unsigned i = 0; i < order; ++i) {
+        x[i] = sign_extend(br_get(br, width), width);
+    }
+
+    uint32_t partitions = partition_count(n);
+    for (uint32_t p = 0; p < partitions && !br->overrun; ++p) {
+        unsigned k = br_get(br, RICE_PARAM_BITS);
+        if (k > MAX_RICE_PARAM) {
+            return false;
+        }
+        uint32_t end = partition_end(p, n);
+        for (uint32_t i = partition_start(p, order); i < end; ++i) {
+            x[i] = zigzag_decode(br_get_rice(br, k));
+        }
+    }
+
+    // restore the samples from the residuals (in unsigned arithmetic, the
+    // values are not trusted before the CRC is checked)
+    uint32_t *u = (uint32_t *) x;
+    switch (order) {
+        case 1:
+            for (uint32_t i = 1; i < n; ++i) {
+                u[i] += u[i - 1];
+            }
+            break;
+        case 2:
+            for (uint32_t i = 2; i < n; ++i) {
+                u[i] += 2 * u[i - 1] - u[i - 2];
+            }
+            break;
+        case 3:
+            for (uint32_t i = 3; i < n; ++i) {
+                u[i] += 3 * u[i - 1] - 3 * u[i - 2] + u[i - 3];
+            }
+            break;
+    }
+
+    return true;
+}
+
+ssize_t
+codec_decode_frame(const uint8_t *buf, size_t len, int16_t *samples,
+                   uint32_t *frames) {
+    if (len < 2) {
+        return 0;
+    }
+    if (buf[0] != SYNC0 || buf[1] != SYNC1) {
+        return -1;
+    }
+    if (len < HEADER_SIZE) {
+        return 0;
+    }
+
+    uint32_t n = buf[2] | (buf[3] << 8);
+    if (!n || n > CODEC_MAX_FRAMES) {
+        return -1;
+    }
+
+    struct bitreader br = {
+        .buf = &buf[HEADER_SIZE],
+        .len = len - HEADER_SIZE,
+        .pos = 0,
+        .acc = 0,
+        .bits = 0,
+        .overrun = false,
+    };
+
+    int32_t a[CODEC_MAX_FRAMES];
+    int32_t b[CODEC_MAX_FRAMES];
+
+    enum stereo_mode mode = br_get(&br, STEREO_MODE_BITS);
+    unsigned width_a = mode == STEREO_SIDE_RIGHT ? 17 : 16;
+    unsigned width_b = mode == STEREO_LEFT_RIGHT ? 16 : 17;
+    bool ok = read_subframe(&br, a, n, width_a)
+           && read_subframe(&br, b, n, width_b);
+
+    if (br.overrun) {
+        // a valid frame is never larger than the max encoded size
+        return len < codec_max_encoded_size(n) ? 0 : -1;
+    }
+
+    if (!ok) {
+        return -1;
+    }
+
+    size_t size = HEADER_SIZE + br_consumed(&br);
+    if (len < size + CRC_SIZE) {
+        return 0;
+    }
+
+    uint16_t crc = buf[size] | (buf[size + 1] << 8);
+    if (crc != crc16(buf, size)) {
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < n; ++i) {
+        int32_t left;
+        int32_t right;
+        switch (mode) {
+            case STEREO_LEFT_RIGHT:
+                left = a[i];
+                right = b[i];
+                break;
+            case STEREO_LEFT_SIDE:
+                left = a[i];
+                right = a[i] - b[i];
+                break;
+            case STEREO_SIDE_RIGHT:
+                left = a[i] + b[i];
+                right = b[i];
+                break;
+            default: { // STEREO_MID_SIDE
+                int32_t mid = (int32_t) ((uint32_t) a[i] << 1) | (b[i] & 1);
+                left = (mid + b[i]) >> 1;
+                right = (mid - b[i]) >> 1;
+                break;
+            }
+        }
+        samples[2 * i] = (int16_t) left;
+        samples[2 * i + 1] = (int16_t) right;
+    }
+
+    *frames = n;
+    return size + CRC_SIZE;
+}
@@ -0,0 +1,59 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// Lossless codec for S16 stereo, similar to FLAC with fixed predictors.
+//
+// The samples are split into independent frames of at most
+// CODEC_MAX_FRAMES frames. Each frame is:
+//
+//     0xFF 0xF5         sync word
+//     u16 frames        little-endian
+//     bitstream         MSB first
+//     u16 crc           CRC-16 (poly 0x8005) of all the previous bytes
+//
+// The bitstream contains the stereo mode (2 bits: L/R, L/S, S/R or M/S)
+// followed by one subframe per channel:
+//  - the subframe type (3 bits): fixed predictor order (0 to 3) or verbatim
+//  - verbatim: every sample as a raw signed value
+//  - fixed: the warm-up samples as raw signed values, then the residuals in
+//    partitions of CODEC_PARTITION_SIZE, each prefixed by its 5-bit Rice
+//    parameter
+// and is padded to a byte boundary.
+//
+// Since every frame is self-contained, a decoder may start anywhere in a
+// stream: it just has to look for the next sync word.
+
+#define CODEC_MAX_FRAMES 2048
+#define CODEC_PARTITION_SIZE 256
+
+// upper bound of the size of the encoded frames for the given number of
+// frames
+size_t
+codec_max_encoded_size(uint32_t frames);
+
+// encode interleaved S16 stereo samples into out (whose capacity must be at
+// least codec_max_encoded_size(frames))
+//
+// return the number of bytes written
+size_t
+codec_encode(const int16_t *samples, uint32_t frames, uint8_t *out);
+
+// return the offset of the first possible frame start in buf (len if none)
+size_t
+codec_find_sync(const uint8_t *buf, size_t len);
+
+// decode the frame at the start of buf into samples (whose capacity must be
+// at least CODEC_MAX_FRAMES frames)
+//
+// return the number of bytes consumed, 0 if buf does not contain the whole
+// frame yet, or -1 if buf does not start with a valid frame (the caller may
+// then skip one byte and look for the next sync word)
+ssize_t
+codec_decode_frame(const uint8_t *buf, size_t len, int16_t *samples,
+                   uint32_t *frames);
+
+#endif
@@ -5,13 +5,14 @@
 
 #include "config.h"
 
+// everything is logged to stderr: stdout may carry the captured stream (-o -)
 #ifndef NDEBUG
-# define LOGD(fmt, ...) printf("[DEBUG] " fmt "\n", ##__VA_ARGS__)
+# define LOGD(fmt, ...) fprintf(stderr, "[DEBUG] " fmt "\n", ##__VA_ARGS__)
 #else
 # define LOGD(fmt, ...)
 #endif
-#define LOGI(fmt, ...) printf("[INFO] " fmt "\n", ##__VA_ARGS__)
-#define LOGW(fmt, ...) printf("[WARN] " fmt "\n", ##__VA_ARGS__)
+#define LOGI(fmt, ...) fprintf(stderr, "[INFO] " fmt "\n", ##__VA_ARGS__)
+#define LOGW(fmt, ...) fprintf(stderr, "[WARN] " fmt "\n", ##__VA_ARGS__)
 #define LOGE(fmt, ...) fprintf(stderr, "[ERROR] " fmt "\n", ##__VA_ARGS__)
 
 #endif
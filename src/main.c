@@ -1,24 +1,38 @@
+#define _POSIX_C_SOURCE 200809L
 #include <assert.h>
 #include <getopt.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "aoa.h"
+#include "audio.h"
+#include "backend.h"
 #include "log.h"
-#include "pulse.h"
+#include "output.h"
+#include "plc.h"
 
-#define DEFAULT_VLC_LIVE_CACHING 50
+#define DEFAULT_LIVE_CACHING 50
+#define WAIT_INPUT_SOURCE_MS 2000
+
+#define AOA_VID 0x18D1
 
 struct args {
+    const char *backend;
     bool help;
     bool play;
+    bool compress;
+    const char *output;
     const char *serial;
     uint16_t vid;
     uint16_t pid;
     uint32_t live_caching;
+    const char *playback_device;
+    const char *capture_device;
+    bool conceal;
 };
 
 static bool
@@ -98,16 +112,31 @@ parse_live_caching(const char *s, uint32_t *result) {
 static bool
 parse_args(struct args *args, int argc, char *argv[]) {
 #define OPT_LIVE_CACHING 1000
+#define OPT_PLAYBACK_DEVICE 1001
+#define OPT_CAPTURE_DEVICE 1002
+#define OPT_NO_CONCEAL 1003
     static const struct option long_opts[] = {
+        {"backend",      required_argument, NULL, 'b'},
+        {"capture-device", required_argument, NULL, OPT_CAPTURE_DEVICE},
+        {"compress",     no_argument,       NULL, 'c'},
         {"device",       required_argument, NULL, 'd'},
         {"help",         no_argument,       NULL, 'h'},
         {"live-caching", required_argument, NULL, OPT_LIVE_CACHING},
+        {"no-conceal",   no_argument,       NULL, OPT_NO_CONCEAL},
         {"no-play",      no_argument,       NULL, 'n'},
+        {"output",       required_argument, NULL, 'o'},
+        {"playback-device", required_argument, NULL, OPT_PLAYBACK_DEVICE},
         {"serial",       required_argument, NULL, 's'},
     };
     int c;
-    while ((c = getopt_long(argc, argv, "d:hns:", long_opts, NULL)) != -1) {
+    while ((c = getopt_long(argc, argv, "b:cd:hno:s:", long_opts, NULL)) != -1) {
         switch (c) {
+            case 'b':
+                args->backend = optarg;
+                break;
+            case 'c':
+                args->compress = true;
+                break;
             case 'd':
                 if (!parse_device(optarg, &args->vid, &args->pid)) {
                     return false;
@@ -119,6 +148,9 @@ parse_args(struct args *args, int argc, char *argv[]) {
             case 'n':
                 args->play = false;
                 break;
+            case 'o':
+                args->output = optarg;
+                break;
             case 's':
                 args->serial = optarg;
                 break;
@@ -127,6 +159,15 @@ parse_args(struct args *args, int argc, char *argv[]) {
                     return false;
                 }
                 break;
+            case OPT_PLAYBACK_DEVICE:
+                args->playback_device = optarg;
+                break;
+            case OPT_CAPTURE_DEVICE:
+                args->capture_device = optarg;
+                break;
+            case OPT_NO_CONCEAL:
+                args->conceal = false;
+                break;
             default:
                 // getopt prints the error message on stderr
                 return false;
@@ -147,6 +188,17 @@ static void usage(const char *arg0) {
         "\n"
         "Options:\n"
         "\n"
+        "    -b, --backend name\n"
+        "        Audio system to capture the device from: %s.\n"
+        "        Default is pulse.\n"
+        "\n"
+        "    --capture-device name\n"
+        "        Capture from this device instead of the USB device, without\n"
+        "        enabling the audio accessory (alsa only, for testing).\n"
+        "\n"
+        "    -c, --compress\n"
+        "        Compress the output losslessly (see --output).\n"
+        "\n"
         "    -d, --device pid:vid\n"
         "        Lookup the USB device by pid:vid.\n"
         "\n"
@@ -154,33 +206,140 @@ static void usage(const char *arg0) {
         "        Print this help.\n"
         "\n"
         "    --live-caching ms\n"
-        "        Forward the option to VLC. Default is %dms.\n"
+        "        Target latency of the playback buffer (pulse only).\n"
+        "        Default is %dms.\n"
+        "\n"
+        "    --no-conceal\n"
+        "        Do not conceal the frames lost by the capture (with --output\n"
+        "        or the pulse and alsa backends). By default, they are\n"
+        "        extrapolated from the previous frames, and flagged in the\n"
+        "        output.\n"
         "\n"
         "    -n, --no-play\n"
         "        Do not play the input source matching the device.\n"
         "\n"
+        "    -o, --output file\n"
+        "        Write the captured audio to a file (\"-\" for stdout)\n"
+        "        instead of playing it. Each block is tagged with its\n"
+        "        CLOCK_MONOTONIC capture time.\n"
+        "\n"
+        "    --playback-device name\n"
+        "        Play to this device instead of the default one, for the\n"
+        "        backends playing by themselves (alsa, pipewire, and pulse\n"
+        "        where it is the name of a sink).\n"
+        "\n"
         "    -s, --serial serial\n"
         "        Lookup the USB device by serial.\n"
-        "\n", arg0, DEFAULT_VLC_LIVE_CACHING);
+        "\n", arg0, backend_names(), DEFAULT_LIVE_CACHING);
+}
+
+static inline bool
+is_aoa_audio(const struct usb_device *device) {
+    // <https://source.android.com/devices/accessories/aoa2>
+    return device->vid == AOA_VID && device->pid >= 0x2D02
+                                  && device->pid <= 0x2D05;
+}
+
+static void
+sleep_ms(unsigned ms) {
+    struct timespec ts = {
+        .tv_sec = ms / 1000,
+        .tv_nsec = (ms % 1000) * 1000000,
+    };
+    nanosleep(&ts, NULL);
+}
+
+// wait for the device to re-enumerate with AOA audio enabled
+static void
+wait_accessory(struct aoa_watcher *watcher, const char *serial,
+               uint64_t deadline) {
+    if (!watcher->hotplug) {
+        // no way to be notified
+        sleep_ms(WAIT_INPUT_SOURCE_MS);
+        return;
+    }
+
+    struct lookup lookup = {
+        .type = LOOKUP_BY_SERIAL,
+        .serial = serial,
+    };
+    uint64_t now;
+    while ((now = audio_clock_now()) < deadline) {
+        unsigned timeout_ms = (deadline - now) / 1000000 + 1;
+        if (!aoa_update_devices(watcher, timeout_ms)) {
+            return;
+        }
+        for (struct usb_device *d = usb_registry_find(watcher->registry,
+                                                      &lookup, NULL);
+                d; d = usb_registry_find(watcher->registry, &lookup, d)) {
+            if (is_aoa_audio(d)) {
+                LOGD("Accessory enumerated: %s", d->path);
+                return;
+            }
+        }
+    }
 }
 
-static inline const char *
-get_vlc_command(void) {
-    const char *vlc = getenv("VLC");
-    if (!vlc) {
-        vlc = "vlc";
+// the input source is created shortly after the USB device
+static int
+wait_input_source(const struct backend *backend, const char *serial,
+                  uint64_t deadline) {
+    for (;;) {
+        int nr = backend->find_source(serial);
+        if (nr >= 0 || audio_clock_now() >= deadline) {
+            return nr;
+        }
+        sleep_ms(100);
     }
-    return vlc;
+}
+
+static int
+capture_or_play(const struct backend *backend, int source,
+                const struct args *args) {
+    if (args->output) {
+        struct output output;
+        enum output_codec codec = args->compress ? OUTPUT_CODEC_LOSSLESS
+                                                 : OUTPUT_CODEC_RAW;
+        if (!output_open(&output, args->output, codec)) {
+            return 1;
+        }
+
+        bool ok;
+        if (args->conceal) {
+            // conceal the holes of the captured stream
+            struct plc plc;
+            plc_init(&plc, output_block_cb, &output);
+            ok = backend->capture(source, plc_block_cb, &plc);
+            plc_destroy(&plc);
+        } else {
+            ok = backend->capture(source, output_block_cb, &output);
+        }
+        output_close(&output);
+        return ok ? 0 : 1;
+    }
+
+    struct play_params params = {
+        .live_caching = args->live_caching,
+        .device = args->playback_device,
+        .conceal = args->conceal,
+    };
+    return backend->play(source, &params) ? 0 : 1;
 }
 
 int main(int argc, char *argv[]) {
     struct args args = {
+        .backend = "pulse",
         .help = false,
         .play = true,
+        .compress = false,
+        .output = NULL,
         .serial = NULL,
         .vid = 0,
         .pid = 0,
-        .live_caching = DEFAULT_VLC_LIVE_CACHING,
+        .live_caching = DEFAULT_LIVE_CACHING,
+        .playback_device = NULL,
+        .capture_device = NULL,
+        .conceal = true,
     };
 
     if (!parse_args(&args, argc, argv)) {
@@ -197,6 +356,54 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    if (!args.play && args.output) {
+        LOGE("Could not provide --no-play and --output simultaneously");
+        return 1;
+    }
+
+    if (args.compress && !args.output) {
+        LOGE("Could not compress without --output");
+        return 1;
+    }
+
+    if (!backend_exists(args.backend)) {
+        LOGE("Unknown backend: %s (available: %s)", args.backend,
+             backend_names());
+        return 1;
+    }
+
+    if (args.capture_device) {
+        if (!args.play) {
+            LOGE("Could not provide --no-play and --capture-device "
+                 "simultaneously");
+            return 1;
+        }
+
+        // no USB device involved
+        const struct backend *backend = backend_load(args.backend);
+        if (!backend) {
+            return 1;
+        }
+
+        if (!backend->set_capture_device) {
+            LOGE("The %s backend does not support --capture-device",
+                 backend->name);
+            return 1;
+        }
+
+        if (!backend->set_capture_device(args.capture_device)) {
+            return 1;
+        }
+
+        int nr = backend->find_source(NULL);
+        if (nr < 0) {
+            LOGE("Could not open capture device %s", args.capture_device);
+            return 1;
+        }
+
+        return capture_or_play(backend, nr, &args);
+    }
+
     if (!aoa_init()) {
         LOGE("Could not initialize AOA");
         return 1;
@@ -214,75 +421,85 @@ int main(int argc, char *argv[]) {
         lookup.type = LOOKUP_BY_ADB_INTERFACE;
     }
 
-    struct usb_device devices[32];
-    ssize_t ndevices = aoa_find_devices(&lookup, devices, 32);
-    if (ndevices < 0) {
-        LOGE("Could not get USB devices");
+    struct usb_registry registry;
+    if (!usb_registry_init(&registry, aoa_read_serial, aoa_has_adb)) {
+        aoa_exit();
         return 1;
     }
 
-    if (ndevices == 0) {
+    struct aoa_watcher watcher;
+    if (!aoa_watch_devices(&watcher, &registry)) {
+        LOGE("Could not get USB devices");
+        goto error_registry_destroy;
+    }
+
+    struct usb_device *device = usb_registry_find(&registry, &lookup, NULL);
+    if (!device) {
         LOGE("Could not find device");
-        return 1;
+        goto error_unwatch;
     }
 
-    if (ndevices > 1) {
+    if (usb_registry_find(&registry, &lookup, device)) {
         LOGE("Several devices found:");
-        for (size_t i = 0; i < ndevices; ++i) {
-            struct usb_device *d = &devices[i];
+        for (struct usb_device *d = device; d;
+                d = usb_registry_find(&registry, &lookup, d)) {
             LOGE("   [%04x:%04x] %s", d->vid, d->pid, d->serial);
-            aoa_destroy_device(&devices[i]);
         }
-        return 1;
+        goto error_unwatch;
     }
 
-    struct usb_device *device = &devices[0];
-
     LOGI("Device: [%04x:%04x] %s", device->vid, device->pid, device->serial);
 
     if (!aoa_forward_audio(device)) {
         LOGE("Could not forward audio");
-        aoa_destroy_device(device);
-        return 1;
+        goto error_unwatch;
     }
 
     LOGI("Audio forwarding enabled");
 
-    aoa_exit();
-
     if (!args.play) {
         // nothing more to do
-        aoa_destroy_device(device);
+        aoa_unwatch_devices(&watcher);
+        usb_registry_destroy(&registry);
+        aoa_exit();
         return 0;
     }
 
-    if (device->pid < 0x2D02 || device->pid > 0x2D05) {
+    // loaded only now, the dependencies are not needed to enable the audio
+    // accessory
+    const struct backend *backend = backend_load(args.backend);
+    if (!backend) {
+        goto error_unwatch;
+    }
+
+    // the device will be removed from the registry if it re-enumerates
+    char serial[128];
+    snprintf(serial, sizeof(serial), "%s", device->serial);
+
+    uint64_t deadline = audio_clock_now() + WAIT_INPUT_SOURCE_MS * 1000000;
+    if (!is_aoa_audio(device)) {
         // the AOA audio was already enabled, no need to wait
-        // <https://source.android.com/devices/accessories/aoa2>
         LOGI("Waiting for input source...");
-        sleep(2);
+        wait_accessory(&watcher, serial, deadline);
     }
 
-    int nr = pulse_get_device_number(device->serial);
-    aoa_destroy_device(device);
+    // the registry is not needed anymore
+    aoa_unwatch_devices(&watcher);
+    usb_registry_destroy(&registry);
+    aoa_exit();
+
+    int nr = wait_input_source(backend, serial, deadline);
     if (nr < 0) {
-        LOGE("Could not find matching PulseAudio input source");
+        LOGE("Could not find matching input source (%s)", backend->name);
         return 1;
     }
 
-    char url[20];
-    snprintf(url, sizeof(url), "pulse://%d", nr);
-
-    LOGI("Playing %s", url);
+    return capture_or_play(backend, nr, &args);
 
-    char caching[32];
-    snprintf(caching, sizeof(caching), "--live-caching=%d", args.live_caching);
-
-    const char *vlc = get_vlc_command();
-
-    // let's become VLC
-    execlp(vlc, vlc, "-Idummy", caching, "--play-and-exit", url, NULL);
-
-    LOGE("Could not start VLC: %s", vlc);
+error_unwatch:
+    aoa_unwatch_devices(&watcher);
+error_registry_destroy:
+    usb_registry_destroy(&registry);
+    aoa_exit();
     return 1;
 }
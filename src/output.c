@@ -0,0 +1,145 @@
+#define _POSIX_C_SOURCE 200809L
+#include "output.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "codec.h"
+#include "log.h"
+
+#define OUTPUT_VERSION 2
+#define STREAM_HEADER_SIZE 16
+#define BLOCK_HEADER_SIZE 24
+
+static inline void
+write16le(uint8_t *buf, uint16_t value) {
+    buf[0] = value;
+    buf[1] = value >> 8;
+}
+
+static inline void
+write32le(uint8_t *buf, uint32_t value) {
+    write16le(buf, value);
+    write16le(&buf[2], value >> 16);
+}
+
+static inline void
+write64le(uint8_t *buf, uint64_t value) {
+    write32le(buf, value);
+    write32le(&buf[4], value >> 32);
+}
+
+static bool
+write_all(int fd, const void *data, size_t len) {
+    const uint8_t *ptr = data;
+    while (len) {
+        ssize_t w = write(fd, ptr, len);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOGE("Could not write output: %s", strerror(errno));
+            return false;
+        }
+        ptr += w;
+        len -= w;
+    }
+    return true;
+}
+
+bool
+output_open(struct output *output, const char *path,
+            enum output_codec codec) {
+    output->codec = codec;
+    output->buf = NULL;
+    output->buf_size = 0;
+
+    if (!strcmp(path, "-")) {
+        output->fd = STDOUT_FILENO;
+        output->close_fd = false;
+    } else {
+        output->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (output->fd < 0) {
+            LOGE("Could not open %s: %s", path, strerror(errno));
+            return false;
+        }
+        output->close_fd = true;
+    }
+
+    uint8_t header[STREAM_HEADER_SIZE];
+    memcpy(header, "USBA", 4);
+    write16le(&header[4], OUTPUT_VERSION);
+    write16le(&header[6], AUDIO_CHANNELS);
+    write32le(&header[8], AUDIO_RATE);
+    write32le(&header[12], codec);
+
+    if (!write_all(output->fd, header, sizeof(header))) {
+        output_close(output);
+        return false;
+    }
+
+    return true;
+}
+
+void
+output_close(struct output *output) {
+    if (output->close_fd) {
+        close(output->fd);
+    }
+    free(output->buf);
+}
+
+static bool
+output_reserve(struct output *output, size_t size) {
+    if (size <= output->buf_size) {
+        return true;
+    }
+
+    uint8_t *buf = realloc(output->buf, size);
+    if (!buf) {
+        LOGE("Could not allocate output buffer");
+        return false;
+    }
+
+    output->buf = buf;
+    output->buf_size = size;
+    return true;
+}
+
+bool
+output_write_block(struct output *output, const struct audio_block *block) {
+    if (!block->data) {
+        // lost frames, not concealed
+        return true;
+    }
+
+    const void *payload = block->data;
+    uint32_t size = block->frames * AUDIO_FRAME_SIZE;
+
+    if (output->codec == OUTPUT_CODEC_LOSSLESS) {
+        if (!output_reserve(output, codec_max_encoded_size(block->frames))) {
+            return false;
+        }
+        size = codec_encode(block->data, block->frames, output->buf);
+        payload = output->buf;
+    }
+
+    uint8_t header[BLOCK_HEADER_SIZE];
+    memcpy(header, "UABK", 4);
+    write64le(&header[4], block->pts);
+    write32le(&header[12], block->frames);
+    write32le(&header[16], block->concealed ? OUTPUT_BLOCK_CONCEALED : 0);
+    write32le(&header[20], size);
+
+    return write_all(output->fd, header, sizeof(header))
+        && write_all(output->fd, payload, size);
+}
+
+bool
+output_block_cb(const struct audio_block *block, void *userdata) {
+    struct output *output = userdata;
+    return output_write_block(output, block);
+}
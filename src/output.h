@@ -0,0 +1,67 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "audio.h"
+
+// Timestamped stream written to a file or to stdout.
+//
+// All values are little-endian. The stream starts with a 16-byte header:
+//
+//     "USBA"        magic
+//     u16 version   currently 2
+//     u16 channels
+//     u32 rate
+//     u32 codec     OUTPUT_CODEC_RAW or OUTPUT_CODEC_LOSSLESS
+//
+// Then each captured block is written as:
+//
+//     "UABK"        sync word
+//     u64 pts       capture time of the first frame, CLOCK_MONOTONIC ns
+//     u32 frames
+//     u32 flags     OUTPUT_BLOCK_* values
+//     u32 size      payload size in bytes
+//     payload       interleaved S16LE samples, or codec frames (see codec.h)
+//
+// The frames lost by the capture are either concealed (and the blocks
+// containing synthesized frames are flagged OUTPUT_BLOCK_CONCEALED), or, if
+// the concealment is disabled, just missing (the pts of the next block
+// reflects the discontinuity).
+//
+// Since the pts is expressed on the CLOCK_MONOTONIC clock of the host, any
+// local consumer can schedule the playback against its own clock.
+enum output_codec {
+    OUTPUT_CODEC_RAW = 0,
+    OUTPUT_CODEC_LOSSLESS = 1,
+};
+
+// the block contains frames synthesized by the packet loss concealment
+#define OUTPUT_BLOCK_CONCEALED 0x1
+
+struct output {
+    int fd;
+    bool close_fd;
+    enum output_codec codec;
+    // encoding buffer
+    uint8_t *buf;
+    size_t buf_size;
+};
+
+// path "-" means stdout
+bool
+output_open(struct output *output, const char *path,
+            enum output_codec codec);
+
+void
+output_close(struct output *output);
+
+bool
+output_write_block(struct output *output, const struct audio_block *block);
+
+// to be used as an audio_block_cb
+bool
+output_block_cb(const struct audio_block *block, void *userdata);
+
+#endif
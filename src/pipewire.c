@@ -0,0 +1,714 @@
+#define _GNU_SOURCE // for the SPA headers
+#include "pipewire.h"
+
+#include <errno.h>
+#include <pipewire/impl-module.h>
+#include <pipewire/pipewire.h>
+#include <spa/param/audio/format-utils.h>
+#include <spa/param/latency-utils.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+
+// request a small quantum (~5.8ms) to the graph
+#define PIPEWIRE_NODE_LATENCY "256/44100"
+
+#ifdef PW_KEY_TARGET_OBJECT
+# define PIPEWIRE_TARGET_KEY PW_KEY_TARGET_OBJECT
+#else
+// libpipewire < 0.3.64: "node.target" expects the node id (or name), not the
+// object serial
+# define PIPEWIRE_TARGET_KEY PW_KEY_NODE_TARGET
+#endif
+
+struct pipewire_connection {
+    struct pw_main_loop *loop;
+    struct pw_context *context;
+    struct pw_core *core;
+    struct spa_hook core_listener;
+    int pending_seq;
+    bool error;
+};
+
+static void
+core_done_cb(void *userdata, uint32_t id, int seq) {
+    struct pipewire_connection *conn = userdata;
+    if (id == PW_ID_CORE && seq == conn->pending_seq) {
+        pw_main_loop_quit(conn->loop);
+    }
+}
+
+static void
+core_error_cb(void *userdata, uint32_t id, int seq, int res,
+              const char *message) {
+    (void) seq;
+    (void) res;
+    struct pipewire_connection *conn = userdata;
+    LOGE("PipeWire error: %s", message);
+    if (id == PW_ID_CORE) {
+        conn->error = true;
+        pw_main_loop_quit(conn->loop);
+    }
+}
+
+static const struct pw_core_events core_events = {
+    PW_VERSION_CORE_EVENTS,
+    .done = core_done_cb,
+    .error = core_error_cb,
+};
+
+static bool
+pipewire_connect(struct pipewire_connection *conn) {
+    pw_init(NULL, NULL);
+
+    conn->error = false;
+    conn->loop = pw_main_loop_new(NULL);
+    if (!conn->loop) {
+        LOGE("Could not create PipeWire main loop");
+        goto error_deinit;
+    }
+
+    conn->context = pw_context_new(pw_main_loop_get_loop(conn->loop), NULL,
+                                   0);
+    if (!conn->context) {
+        LOGE("Could not create PipeWire context");
+        goto error_loop_destroy;
+    }
+
+    conn->core = pw_context_connect(conn->context, NULL, 0);
+    if (!conn->core) {
+        LOGE("Could not connect to PipeWire");
+        goto error_context_destroy;
+    }
+
+    spa_zero(conn->core_listener);
+    pw_core_add_listener(conn->core, &conn->core_listener, &core_events,
+                         conn);
+    return true;
+
+error_context_destroy:
+    pw_context_destroy(conn->context);
+error_loop_destroy:
+    pw_main_loop_destroy(conn->loop);
+error_deinit:
+    pw_deinit();
+
+    return false;
+}
+
+static void
+pipewire_disconnect(struct pipewire_connection *conn) {
+    spa_hook_remove(&conn->core_listener);
+    pw_core_disconnect(conn->core);
+    pw_context_destroy(conn->context);
+    pw_main_loop_destroy(conn->loop);
+    pw_deinit();
+}
+
+// wait until the server has processed all the previous requests
+static bool
+pipewire_roundtrip(struct pipewire_connection *conn) {
+    conn->pending_seq = pw_core_sync(conn->core, PW_ID_CORE, 0);
+    pw_main_loop_run(conn->loop);
+    return !conn->error;
+}
+
+struct pipewire_find_data {
+    const char *serial;
+    size_t serial_len;
+    int source;
+};
+
+static bool
+node_name_matches(const char *name, const char *serial, size_t len) {
+    // The node name contains the udev serial, which follows the pattern
+    // "manufacturer_model_serial", for example:
+    // "alsa_input.usb-manufacturer_model_serial-00.analog-stereo"
+    for (const char *p = strchr(name, '_'); p; p = strchr(p + 1, '_')) {
+        if (!strncmp(p + 1, serial, len) && p[len + 1] == '-') {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void
+registry_global_cb(void *userdata, uint32_t id, uint32_t permissions,
+                   const char *type, uint32_t version,
+                   const struct spa_dict *props) {
+    (void) permissions;
+    (void) version;
+    struct pipewire_find_data *data = userdata;
+    if (data->source >= 0 || !props || strcmp(type, PW_TYPE_INTERFACE_Node)) {
+        return;
+    }
+
+    const char *media_class = spa_dict_lookup(props, PW_KEY_MEDIA_CLASS);
+    if (!media_class || strcmp(media_class, "Audio/Source")) {
+        return;
+    }
+
+    const char *name = spa_dict_lookup(props, PW_KEY_NODE_NAME);
+    if (!name) {
+        return;
+    }
+    LOGD("%s ? %s", data->serial, name);
+    if (!node_name_matches(name, data->serial, data->serial_len)) {
+        return;
+    }
+
+#ifdef PW_KEY_TARGET_OBJECT
+    // the object serial is not reused, unlike the id
+    const char *object_serial = spa_dict_lookup(props, PW_KEY_OBJECT_SERIAL);
+    data->source = object_serial ? atoi(object_serial) : (int) id;
+#else
+    data->source = id;
+#endif
+    LOGI("Matching PipeWire source node found: %d (%s)", data->source,
+         name);
+}
+
+static const struct pw_registry_events registry_events = {
+    PW_VERSION_REGISTRY_EVENTS,
+    .global = registry_global_cb,
+};
+
+int
+pipewire_find_source(const char *serial) {
+    struct pipewire_connection conn;
+    if (!pipewire_connect(&conn)) {
+        return -1;
+    }
+
+    struct pipewire_find_data data = {
+        .serial = serial,
+        .serial_len = strlen(serial),
+        .source = -1,
+    };
+
+    struct pw_registry *registry =
+        pw_core_get_registry(conn.core, PW_VERSION_REGISTRY, 0);
+    struct spa_hook registry_listener;
+    spa_zero(registry_listener);
+    pw_registry_add_listener(registry, &registry_listener, &registry_events,
+                             &data);
+
+    // all the existing globals are announced before the sync is done
+    pipewire_roundtrip(&conn);
+
+    spa_hook_remove(&registry_listener);
+    pw_proxy_destroy((struct pw_proxy *) registry);
+    pipewire_disconnect(&conn);
+
+    return data.source;
+}
+
+// latency of one side of the loopback, read from the Latency param of a port
+// of one of its nodes
+struct loopback_latency {
+    struct pipewire_session *session;
+    const char *node_name;
+    const char *port_direction; // "in" or "out"
+    // SPA_DIRECTION_OUTPUT for the latency from the source up to the port,
+    // SPA_DIRECTION_INPUT for the latency from the port down to the sink
+    enum spa_direction latency_direction;
+
+    uint32_t node_id; // SPA_ID_INVALID if not found yet
+    struct pw_port *port; // NULL if not bound yet
+    struct spa_hook port_listener;
+    bool received;
+    uint64_t latency; // in ns
+};
+
+struct pipewire_session {
+    struct pipewire_connection conn;
+
+    struct pw_stream *capture;
+    struct spa_hook capture_listener;
+    audio_block_cb cb;
+    void *userdata;
+
+    // only for playback
+    struct pw_impl_module *loopback;
+    struct spa_hook loopback_listener;
+    uint64_t captured; // in frames
+    uint32_t graph_rate; // 0 if unknown
+    uint32_t quantum; // in frames (at AUDIO_RATE)
+    struct pw_registry *registry; // NULL until the latency is requested
+    struct spa_hook registry_listener;
+    struct loopback_latency capture_latency;
+    struct loopback_latency playback_latency;
+    bool latency_reported;
+};
+
+static uint64_t
+stream_delay_ns(struct pw_stream *stream, uint64_t *now, uint32_t *rate) {
+    struct pw_time time;
+    if (pw_stream_get_time_n(stream, &time, sizeof(time)) < 0
+            || !time.rate.denom || !time.now) {
+        *now = audio_clock_now();
+        return 0;
+    }
+
+    // time.now is the CLOCK_MONOTONIC time of the current graph cycle
+    *now = time.now;
+    // time.rate is 1/rate of the graph
+    *rate = time.rate.num == 1 ? time.rate.denom : 0;
+    if (time.delay <= 0) {
+        return 0;
+    }
+    return (uint64_t) time.delay * time.rate.num * NS_PER_SEC
+         / time.rate.denom;
+}
+
+static void
+stream_state_changed_cb(void *userdata, enum pw_stream_state old,
+                        enum pw_stream_state state, const char *error) {
+    (void) old;
+    struct pipewire_session *session = userdata;
+    LOGD("PipeWire stream: %s", pw_stream_state_as_string(state));
+    if (state == PW_STREAM_STATE_ERROR
+            || state == PW_STREAM_STATE_UNCONNECTED) {
+        // the device has been unplugged, or the stream could not be linked
+        LOGE("PipeWire stream %s%s%s", pw_stream_state_as_string(state),
+             error ? ": " : "", error ? error : "");
+        session->conn.error = true;
+        pw_main_loop_quit(session->conn.loop);
+    }
+}
+
+static void
+capture_process_cb(void *userdata) {
+    struct pipewire_session *session = userdata;
+    struct pw_buffer *b = pw_stream_dequeue_buffer(session->capture);
+    if (!b) {
+        return;
+    }
+
+    struct spa_data *d = &b->buffer->datas[0];
+    if (d->data && d->chunk) {
+        uint32_t offset = SPA_MIN(d->chunk->offset, d->maxsize);
+        uint32_t size = SPA_MIN(d->chunk->size, d->maxsize - offset);
+
+        uint64_t now;
+        uint64_t delay = stream_delay_ns(session->capture, &now,
+                                         &session->graph_rate);
+
+        struct audio_block block = {
+            .pts = now - delay,
+            .frames = size / AUDIO_FRAME_SIZE,
+            .data = SPA_PTROFF(d->data, offset, const int16_t),
+        };
+        if (block.frames && !session->cb(&block, session->userdata)) {
+            pw_main_loop_quit(session->conn.loop);
+        }
+    }
+
+    pw_stream_queue_buffer(session->capture, b);
+}
+
+static const struct pw_stream_events capture_events = {
+    PW_VERSION_STREAM_EVENTS,
+    .state_changed = stream_state_changed_cb,
+    .process = capture_process_cb,
+};
+
+static struct pw_stream *
+create_stream(struct pipewire_session *session, const char *name,
+              enum spa_direction direction, const char *target,
+              const struct pw_stream_events *events,
+              struct spa_hook *listener) {
+    struct pw_properties *props =
+        pw_properties_new(PW_KEY_MEDIA_TYPE, "Audio",
+                          PW_KEY_MEDIA_CATEGORY,
+                          direction == PW_DIRECTION_INPUT ? "Capture"
+                                                          : "Playback",
+                          PW_KEY_MEDIA_ROLE, "Music",
+                          PW_KEY_NODE_LATENCY, PIPEWIRE_NODE_LATENCY,
+                          NULL);
+    if (!props) {
+        LOGE("Could not create PipeWire stream properties");
+        return NULL;
+    }
+    if (target) {
+        pw_properties_set(props, PIPEWIRE_TARGET_KEY, target);
+        // do not move to another node when the device is unplugged
+        pw_properties_set(props, PW_KEY_NODE_DONT_RECONNECT, "true");
+    }
+
+    // takes ownership of props
+    struct pw_stream *stream = pw_stream_new(session->conn.core, name, props);
+    if (!stream) {
+        LOGE("Could not create PipeWire stream");
+        return NULL;
+    }
+
+    spa_zero(*listener);
+    pw_stream_add_listener(stream, listener, events, session);
+
+    uint8_t buffer[1024];
+    struct spa_pod_builder builder = SPA_POD_BUILDER_INIT(buffer,
+                                                          sizeof(buffer));
+    struct spa_audio_info_raw info = {
+        .format = SPA_AUDIO_FORMAT_S16_LE,
+        .rate = AUDIO_RATE,
+        .channels = AUDIO_CHANNELS,
+        .position = { SPA_AUDIO_CHANNEL_FL, SPA_AUDIO_CHANNEL_FR },
+    };
+    const struct spa_pod *params[] = {
+        spa_format_audio_raw_build(&builder, SPA_PARAM_EnumFormat, &info),
+    };
+
+    int r = pw_stream_connect(stream, direction, PW_ID_ANY,
+                              PW_STREAM_FLAG_AUTOCONNECT
+                                  | PW_STREAM_FLAG_MAP_BUFFERS,
+                              params, 1);
+    if (r < 0) {
+        LOGE("Could not connect PipeWire stream: %s", spa_strerror(r));
+        spa_hook_remove(listener);
+        pw_stream_destroy(stream);
+        return NULL;
+    }
+
+    return stream;
+}
+
+static bool
+pipewire_session_init(struct pipewire_session *session, int source,
+                      audio_block_cb cb, void *userdata) {
+    if (!pipewire_connect(&session->conn)) {
+        return false;
+    }
+
+    session->cb = cb;
+    session->userdata = userdata;
+    session->loopback = NULL;
+    session->registry = NULL;
+    session->graph_rate = 0;
+
+    char target[16];
+    snprintf(target, sizeof(target), "%d", source);
+    session->capture = create_stream(session, "usbaudio capture",
+                                     PW_DIRECTION_INPUT, target,
+                                     &capture_events,
+                                     &session->capture_listener);
+    if (!session->capture) {
+        pipewire_disconnect(&session->conn);
+        return false;
+    }
+
+    return true;
+}
+
+static void
+loopback_latency_destroy(struct loopback_latency *ll) {
+    if (ll->port) {
+        spa_hook_remove(&ll->port_listener);
+        pw_proxy_destroy((struct pw_proxy *) ll->port);
+    }
+}
+
+static void
+pipewire_session_destroy(struct pipewire_session *session) {
+    if (session->registry) {
+        loopback_latency_destroy(&session->capture_latency);
+        loopback_latency_destroy(&session->playback_latency);
+        spa_hook_remove(&session->registry_listener);
+        pw_proxy_destroy((struct pw_proxy *) session->registry);
+    }
+    if (session->loopback) {
+        spa_hook_remove(&session->loopback_listener);
+        pw_impl_module_destroy(session->loopback);
+    }
+    spa_hook_remove(&session->capture_listener);
+    pw_stream_destroy(session->capture);
+    pipewire_disconnect(&session->conn);
+}
+
+bool
+pipewire_capture(int source, audio_block_cb cb, void *userdata) {
+    struct pipewire_session session;
+    if (!pipewire_session_init(&session, source, cb, userdata)) {
+        return false;
+    }
+
+    LOGI("Capturing PipeWire source node %d", source);
+
+    // the streams are not RT_PROCESS, so all the callbacks are called from
+    // this loop
+    pw_main_loop_run(session.conn.loop);
+
+    bool ok = !session.conn.error;
+    pipewire_session_destroy(&session);
+    return ok;
+}
+
+// latency of the path described by a Latency param (in ns)
+static uint64_t
+latency_info_ns(const struct spa_latency_info *info, uint32_t quantum,
+                uint32_t graph_rate) {
+    // the max of the range (the paths merged at the port may differ)
+    double ns = (double) info->max_ns
+              + info->max_quantum * audio_frames_to_ns(quantum);
+    if (graph_rate) {
+        ns += (double) info->max_rate * NS_PER_SEC / graph_rate;
+    }
+    return ns > 0 ? (uint64_t) ns : 0;
+}
+
+static void
+report_latency(struct pipewire_session *session) {
+    uint64_t capture = session->capture_latency.latency;
+    uint64_t playback = session->playback_latency.latency;
+    // the loopback copies the samples within the cycle, it adds no latency
+    LOGI("PipeWire latency: %.1fms (capture %.1fms, playback %.1fms, quantum "
+         "%" PRIu32 " frames)", (capture + playback) / 1e6, capture / 1e6,
+         playback / 1e6, session->quantum);
+    session->latency_reported = true;
+}
+
+static void
+port_param_cb(void *userdata, int seq, uint32_t id, uint32_t index,
+              uint32_t next, const struct spa_pod *param) {
+    (void) seq;
+    (void) index;
+    (void) next;
+    struct loopback_latency *ll = userdata;
+    struct pipewire_session *session = ll->session;
+    if (id != SPA_PARAM_Latency || !param || ll->received
+            || session->latency_reported) {
+        return;
+    }
+
+    struct spa_latency_info info;
+    if (spa_latency_parse(param, &info) < 0
+            || info.direction != ll->latency_direction) {
+        return;
+    }
+
+    ll->latency = latency_info_ns(&info, session->quantum,
+                                  session->graph_rate);
+    ll->received = true;
+    LOGD("PipeWire %s latency: %.1fms", ll->node_name, ll->latency / 1e6);
+
+    if (session->capture_latency.received
+            && session->playback_latency.received) {
+        report_latency(session);
+    }
+}
+
+static const struct pw_port_events port_events = {
+    PW_VERSION_PORT_EVENTS,
+    .param = port_param_cb,
+};
+
+static void
+loopback_latency_init(struct loopback_latency *ll,
+                      struct pipewire_session *session, const char *node_name,
+                      const char *port_direction,
+                      enum spa_direction latency_direction) {
+    ll->session = session;
+    ll->node_name = node_name;
+    ll->port_direction = port_direction;
+    ll->latency_direction = latency_direction;
+    ll->node_id = SPA_ID_INVALID;
+    ll->port = NULL;
+    ll->received = false;
+    ll->latency = 0;
+}
+
+static void
+loopback_latency_global(struct loopback_latency *ll, uint32_t id,
+                        const char *type, const struct spa_dict *props) {
+    struct pipewire_session *session = ll->session;
+
+    if (!strcmp(type, PW_TYPE_INTERFACE_Node)) {
+        const char *name = spa_dict_lookup(props, PW_KEY_NODE_NAME);
+        if (name && !strcmp(name, ll->node_name)) {
+            ll->node_id = id;
+        }
+        return;
+    }
+
+    // a node is announced before its ports
+    if (ll->port || ll->node_id == SPA_ID_INVALID
+            || strcmp(type, PW_TYPE_INTERFACE_Port)) {
+        return;
+    }
+
+    const char *node_id = spa_dict_lookup(props, PW_KEY_NODE_ID);
+    const char *direction = spa_dict_lookup(props, PW_KEY_PORT_DIRECTION);
+    const char *monitor = spa_dict_lookup(props, PW_KEY_PORT_MONITOR);
+    if (!node_id || (uint32_t) atoi(node_id) != ll->node_id || !direction
+            || strcmp(direction, ll->port_direction)
+            || (monitor && !strcmp(monitor, "true"))) {
+        return;
+    }
+
+    // all the channels have the same latency, one port is sufficient
+    ll->port = pw_registry_bind(session->registry, id, PW_TYPE_INTERFACE_Port,
+                                PW_VERSION_PORT, 0);
+    if (!ll->port) {
+        LOGW("Could not bind PipeWire port %" PRIu32, id);
+        return;
+    }
+
+    spa_zero(ll->port_listener);
+    pw_port_add_listener(ll->port, &ll->port_listener, &port_events, ll);
+    pw_port_enum_params(ll->port, 0, SPA_PARAM_Latency, 0, UINT32_MAX, NULL);
+}
+
+static void
+latency_registry_global_cb(void *userdata, uint32_t id, uint32_t permissions,
+                           const char *type, uint32_t version,
+                           const struct spa_dict *props) {
+    (void) permissions;
+    (void) version;
+    struct pipewire_session *session = userdata;
+    if (!props) {
+        return;
+    }
+    loopback_latency_global(&session->capture_latency, id, type, props);
+    loopback_latency_global(&session->playback_latency, id, type, props);
+}
+
+static const struct pw_registry_events latency_registry_events = {
+    PW_VERSION_REGISTRY_EVENTS,
+    .global = latency_registry_global_cb,
+};
+
+// The latency of the loopback is the latency from the source to its capture
+// node, plus the latency from its playback node to the sink, as propagated
+// by PipeWire in the Latency params of their ports. The params are received
+// asynchronously, the latency is reported once both are known.
+static void
+request_latency(struct pipewire_session *session) {
+    loopback_latency_init(&session->capture_latency, session,
+                          "usbaudio.capture", "in", SPA_DIRECTION_OUTPUT);
+    loopback_latency_init(&session->playback_latency, session,
+                          "usbaudio.playback", "out", SPA_DIRECTION_INPUT);
+
+    session->registry =
+        pw_core_get_registry(session->conn.core, PW_VERSION_REGISTRY, 0);
+    if (!session->registry) {
+        LOGW("Could not get PipeWire registry, latency unknown");
+        return;
+    }
+
+    spa_zero(session->registry_listener);
+    pw_registry_add_listener(session->registry, &session->registry_listener,
+                             &latency_registry_events, session);
+}
+
+// the captured samples are not used (the loopback plays them), only the
+// timing of the capture
+static bool
+monitor_cb(const struct audio_block *block, void *userdata) {
+    struct pipewire_session *session = userdata;
+    session->captured += block->frames;
+
+    if (!session->registry && session->captured >= AUDIO_RATE) {
+        // request once the capture is running for 1 second; the frames of a
+        // capture cycle is the quantum of the graph
+        session->quantum = block->frames;
+        request_latency(session);
+    }
+
+    return true;
+}
+
+static void
+loopback_destroy_cb(void *userdata) {
+    struct pipewire_session *session = userdata;
+    // the loopback destroys itself when one of its streams is disconnected
+    spa_hook_remove(&session->loopback_listener);
+    session->loopback = NULL;
+    LOGE("PipeWire loopback closed");
+    session->conn.error = true;
+    pw_main_loop_quit(session->conn.loop);
+}
+
+static const struct pw_impl_module_events loopback_events = {
+    PW_VERSION_IMPL_MODULE_EVENTS,
+    .destroy = loopback_destroy_cb,
+};
+
+// link the source to the sink inside the graph: the loopback module copies
+// each capture buffer to the playback stream within the same cycle, without
+// any buffering
+static bool
+load_loopback(struct pipewire_session *session, int source,
+              const char *device) {
+    char args[512];
+    int r = snprintf(args, sizeof(args),
+        "{ node.description = \"usbaudio\""
+        " audio.rate = %d audio.channels = %d audio.position = [ FL FR ]"
+        " capture.props = { node.name = \"usbaudio.capture\""
+            " " PIPEWIRE_TARGET_KEY " = %d node.dont-reconnect = true"
+            " node.latency = \"" PIPEWIRE_NODE_LATENCY "\" }"
+        " playback.props = { node.name = \"usbaudio.playback\""
+            " node.latency = \"" PIPEWIRE_NODE_LATENCY "\"%s%s%s } }",
+        AUDIO_RATE, AUDIO_CHANNELS, source,
+        device ? " " PIPEWIRE_TARGET_KEY " = \"" : "",
+        device ? device : "",
+        device ? "\"" : "");
+    if (r < 0 || (size_t) r >= sizeof(args)) {
+        LOGE("Playback device name too long");
+        return false;
+    }
+
+    session->loopback = pw_context_load_module(session->conn.context,
+                                               "libpipewire-module-loopback",
+                                               args, NULL);
+    if (!session->loopback) {
+        LOGE("Could not load PipeWire loopback module: %s", strerror(errno));
+        return false;
+    }
+
+    spa_zero(session->loopback_listener);
+    pw_impl_module_add_listener(session->loopback,
+                                &session->loopback_listener,
+                                &loopback_events, session);
+    return true;
+}
+
+static bool
+pipewire_play(int source, const struct play_params *params) {
+    // the capture stream only monitors the timing, and requests the quantum
+    // (as does the loopback)
+    struct pipewire_session session;
+    if (!pipewire_session_init(&session, source, monitor_cb, &session)) {
+        return false;
+    }
+
+    session.captured = 0;
+    session.quantum = 0;
+    session.latency_reported = false;
+
+    if (!load_loopback(&session, source, params->device)) {
+        pipewire_session_destroy(&session);
+        return false;
+    }
+
+    LOGI("Playing PipeWire source node %d", source);
+
+    pw_main_loop_run(session.conn.loop);
+
+    bool ok = !session.conn.error;
+    pipewire_session_destroy(&session);
+    return ok;
+}
+
+const struct backend pipewire_backend = {
+    .name = "pipewire",
+    .find_source = pipewire_find_source,
+    .capture = pipewire_capture,
+    .play = pipewire_play,
+};
+
+#ifdef BACKEND_MODULE
+// entry point of the module, see backend_load()
+const struct backend *usbaudio_backend = &pipewire_backend;
+#endif
@@ -0,0 +1,25 @@
+#ifndef PIPEWIRE_H
+#define PIPEWIRE_H
+
+#include <stdbool.h>
+
+#include "audio.h"
+#include "backend.h"
+
+// Capture the source node of the device with a native PipeWire stream (to the
+// output), or play it through a loopback linking it to the sink inside the
+// graph, with a small quantum.
+extern const struct backend pipewire_backend;
+
+// return the object serial (or id with libpipewire < 0.3.64) of the source
+// node of the device, or -1 if not found
+int
+pipewire_find_source(const char *serial);
+
+// capture the source node until cb returns false
+//
+// return false on error
+bool
+pipewire_capture(int source, audio_block_cb cb, void *userdata);
+
+#endif
@@ -0,0 +1,410 @@
+#define _POSIX_C_SOURCE 200809L
+#include "plc.h"
+
+#include <string.h>
+
+#include "log.h"
+
+// number of frames compared to find the pitch period
+#define PLC_WINDOW_FRAMES 256
+
+// weight of each new block in the pts offset and jitter estimations
+#define PLC_SMOOTHING 16
+// a pts deviation is a gap only beyond this number of times the jitter
+#define PLC_JITTER_FACTOR 4
+
+// minimum interval between the reports of the statistics
+#define PLC_REPORT_INTERVAL_NS NS_PER_SEC
+
+void
+plc_init(struct plc *plc, audio_block_cb cb, void *userdata) {
+    plc->cb = cb;
+    plc->userdata = userdata;
+    plc->started = false;
+    plc->start_pts = 0;
+    plc->emitted_frames = 0;
+    plc->offset = 0;
+    plc->jitter = 0;
+    plc->trimmable = 0;
+    plc->reanchor = false;
+    plc->history_frames = 0;
+    plc->period_frames = 0;
+    plc->position = 0;
+    plc->concealing = false;
+    plc->concealed_frames = 0;
+    plc->trimmed_frames = 0;
+    plc->gaps = 0;
+    plc->reported_gaps = 0;
+    plc->report_time = 0;
+}
+
+static void
+plc_report(struct plc *plc) {
+    LOGI("Concealed %" PRIu64 " frames in %" PRIu32 " gaps (%" PRIu64
+         " frames trimmed)", plc->concealed_frames, plc->gaps,
+         plc->trimmed_frames);
+    plc->reported_gaps = plc->gaps;
+}
+
+void
+plc_destroy(struct plc *plc) {
+    if (plc->gaps) {
+        plc_report(plc);
+    }
+}
+
+static inline int16_t
+to_s16(float value) {
+    // the values are always mixes of S16 samples, they cannot overflow
+    return value >= 0 ? (int16_t) (value + 0.5f) : (int16_t) (value - 0.5f);
+}
+
+static void
+plc_remember(struct plc *plc, const int16_t *data, uint32_t frames) {
+    // keep the most recent frames at the end of the history
+    if (frames >= PLC_HISTORY_FRAMES) {
+        memcpy(plc->history,
+               &data[(frames - PLC_HISTORY_FRAMES) * AUDIO_CHANNELS],
+               PLC_HISTORY_FRAMES * AUDIO_FRAME_SIZE);
+        plc->history_frames = PLC_HISTORY_FRAMES;
+        return;
+    }
+
+    uint32_t keep = PLC_HISTORY_FRAMES - frames;
+    memmove(plc->history, &plc->history[frames * AUDIO_CHANNELS],
+            keep * AUDIO_FRAME_SIZE);
+    memcpy(&plc->history[keep * AUDIO_CHANNELS], data,
+           frames * AUDIO_FRAME_SIZE);
+
+    plc->history_frames += frames;
+    if (plc->history_frames > PLC_HISTORY_FRAMES) {
+        plc->history_frames = PLC_HISTORY_FRAMES;
+    }
+}
+
+// the pts expected for the next frame, if it is captured on time
+static inline uint64_t
+plc_expected_pts(const struct plc *plc) {
+    return plc->start_pts + audio_frames_to_ns(plc->emitted_frames)
+         + plc->offset;
+}
+
+static bool
+plc_forward(struct plc *plc, uint64_t pts, const int16_t *data,
+            uint32_t frames, bool concealed) {
+    plc_remember(plc, data, frames);
+    plc->emitted_frames += frames;
+
+    struct audio_block block = {
+        .pts = pts,
+        .frames = frames,
+        .data = data,
+        .concealed = concealed,
+    };
+    return plc->cb(&block, plc->userdata);
+}
+
+// return the lag maximizing the normalized autocorrelation of the last
+// PLC_WINDOW_FRAMES of the (full) history
+static uint32_t
+plc_find_period(const struct plc *plc) {
+    int32_t mono[PLC_HISTORY_FRAMES];
+    for (uint32_t i = 0; i < PLC_HISTORY_FRAMES; ++i) {
+        int32_t sum = 0;
+        for (int c = 0; c < AUDIO_CHANNELS; ++c) {
+            sum += plc->history[i * AUDIO_CHANNELS + c];
+        }
+        mono[i] = sum;
+    }
+
+    const int32_t *x = &mono[PLC_HISTORY_FRAMES - PLC_WINDOW_FRAMES];
+    uint32_t best = PLC_MAX_PERIOD;
+    double best_score = 0;
+    for (uint32_t lag = PLC_MIN_PERIOD; lag <= PLC_MAX_PERIOD; ++lag) {
+        const int32_t *y = x - lag;
+        int64_t corr = 0;
+        int64_t energy = 0;
+        for (int n = 0; n < PLC_WINDOW_FRAMES; ++n) {
+            corr += (int64_t) x[n] * y[n];
+            energy += (int64_t) y[n] * y[n];
+        }
+        if (corr > 0 && energy > 0) {
+            // the energy of x does not depend on the lag
+            double score = (double) corr * corr / energy;
+            if (score > best_score) {
+                best_score = score;
+                best = lag;
+            }
+        }
+    }
+
+    return best;
+}
+
+// extract the last period of the history, its end crossfaded with the frames
+// preceding it, so that it can be repeated without discontinuity
+static void
+plc_prepare_period(struct plc *plc) {
+    if (plc->history_frames < PLC_HISTORY_FRAMES) {
+        // not enough signal to find the pitch, hold the last frame (it fades
+        // out anyway)
+        memcpy(plc->period,
+               &plc->history[(PLC_HISTORY_FRAMES - 1) * AUDIO_CHANNELS],
+               AUDIO_FRAME_SIZE);
+        plc->period_frames = plc->history_frames ? 1 : 0;
+        return;
+    }
+
+    uint32_t period = plc_find_period(plc);
+    uint32_t overlap = period / 4;
+    const int16_t *last = &plc->history[(PLC_HISTORY_FRAMES - period)
+                                        * AUDIO_CHANNELS];
+    const int16_t *prev = &plc->history[(PLC_HISTORY_FRAMES - 2 * period)
+                                        * AUDIO_CHANNELS];
+
+    for (uint32_t k = 0; k < period; ++k) {
+        for (int c = 0; c < AUDIO_CHANNELS; ++c) {
+            uint32_t i = k * AUDIO_CHANNELS + c;
+            if (k < period - overlap) {
+                plc->period[i] = last[i];
+            } else {
+                float w = (float) (k - (period - overlap) + 1) / (overlap + 1);
+                plc->period[i] = to_s16((1 - w) * last[i] + w * prev[i]);
+            }
+        }
+    }
+
+    plc->period_frames = period;
+}
+
+static float
+plc_gain(uint32_t position) {
+    if (position < PLC_HOLD_FRAMES) {
+        return 1;
+    }
+    position -= PLC_HOLD_FRAMES;
+    if (position < PLC_FADE_FRAMES) {
+        return 1 - (float) position / PLC_FADE_FRAMES;
+    }
+    return 0;
+}
+
+static inline float
+plc_extrapolate(const struct plc *plc, uint32_t position, int channel) {
+    if (!plc->period_frames) {
+        return 0;
+    }
+    uint32_t k = position % plc->period_frames;
+    return plc->period[k * AUDIO_CHANNELS + channel] * plc_gain(position);
+}
+
+static bool
+plc_conceal(struct plc *plc, uint64_t gap) {
+    uint32_t frames = gap <= PLC_MAX_GAP_FRAMES
+                    ? gap : PLC_HOLD_FRAMES + PLC_FADE_FRAMES;
+
+    plc_prepare_period(plc);
+    plc->position = 0;
+
+    uint64_t pts = plc_expected_pts(plc);
+    while (plc->position < frames) {
+        uint32_t n = frames - plc->position;
+        if (n > PLC_BLOCK_FRAMES) {
+            n = PLC_BLOCK_FRAMES;
+        }
+
+        for (uint32_t i = 0; i < n; ++i) {
+            for (int c = 0; c < AUDIO_CHANNELS; ++c) {
+                float value = plc_extrapolate(plc, plc->position + i, c);
+                plc->buf[i * AUDIO_CHANNELS + c] = to_s16(value);
+            }
+        }
+
+        uint64_t block_pts = pts + audio_frames_to_ns(plc->position);
+        plc->position += n;
+        if (!plc_forward(plc, block_pts, plc->buf, n, true)) {
+            return false;
+        }
+    }
+
+    plc->concealing = true;
+    plc->concealed_frames += frames;
+    ++plc->gaps;
+    LOGD("Concealed a gap of %" PRIu64 " frames (%" PRIu64 " in total)",
+         gap, plc->concealed_frames);
+    return true;
+}
+
+// detect a gap from the pts of the block
+//
+// The pts of the blocks are noisy (they are computed from the capture
+// latency reported by the backend, when the block is received) and drift
+// slowly against the sample clock. So the deviation from the expected pts is
+// measured against a smoothed offset, and is a gap only beyond
+// PLC_JITTER_FACTOR times the measured jitter.
+//
+// set the number of frames to trim from the start of the block (if it
+// overlaps the previous concealment), and return false if the callback
+// requested to stop
+static bool
+plc_detect_gap(struct plc *plc, const struct audio_block *block,
+               uint32_t *trim) {
+    *trim = 0;
+
+    // only the block immediately following a concealment may be trimmed
+    uint64_t trimmable = plc->trimmable;
+    plc->trimmable = 0;
+
+    if (!plc->started) {
+        plc->started = true;
+        plc->start_pts = block->pts;
+        // be conservative until the jitter is measured
+        plc->jitter = audio_frames_to_ns(PLC_MIN_GAP_FRAMES);
+        return true;
+    }
+
+    if (plc->reanchor) {
+        // a hole longer than PLC_MAX_GAP_FRAMES was reported by the backend,
+        // only the fade out was inserted: restart from this block
+        plc->reanchor = false;
+        plc->start_pts = block->pts - plc->offset;
+        plc->emitted_frames = 0;
+        return true;
+    }
+
+    int64_t deviation = (int64_t) (block->pts - plc_expected_pts(plc));
+    uint64_t abs_deviation = deviation >= 0 ? deviation : -deviation;
+
+    uint64_t threshold = PLC_JITTER_FACTOR * plc->jitter;
+    if (threshold < audio_frames_to_ns(PLC_MIN_GAP_FRAMES)) {
+        threshold = audio_frames_to_ns(PLC_MIN_GAP_FRAMES);
+    }
+
+    // a large deviation (a gap) also increases the jitter estimation, so
+    // that the threshold adapts if it is actually a spike of jitter
+    plc->jitter += ((int64_t) abs_deviation - (int64_t) plc->jitter)
+                 / PLC_SMOOTHING;
+
+    if (deviation > (int64_t) threshold) {
+        uint64_t gap = audio_ns_to_frames(deviation);
+        if (!plc_conceal(plc, gap)) {
+            return false;
+        }
+        if (gap > PLC_MAX_GAP_FRAMES) {
+            // only the fade out was inserted, restart from this block
+            plc->start_pts = block->pts - plc->offset;
+            plc->emitted_frames = 0;
+        } else {
+            // if this was a spike of jitter, the next block will overlap
+            plc->trimmable = gap;
+        }
+        return true;
+    }
+
+    if (deviation < -(int64_t) threshold && trimmable) {
+        // the previous gap was (partially) a spike of jitter: remove the
+        // frames which overlap the concealed ones
+        uint64_t overlap = audio_ns_to_frames(-deviation);
+        if (overlap > trimmable) {
+            overlap = trimmable;
+        }
+        *trim = overlap < block->frames ? overlap : block->frames;
+        plc->trimmed_frames += *trim;
+        return true;
+    }
+
+    plc->offset += deviation / PLC_SMOOTHING;
+    return true;
+}
+
+bool
+plc_push(struct plc *plc, const struct audio_block *block) {
+    if (plc->gaps != plc->reported_gaps) {
+        // report while capturing: the capture is usually interrupted by a
+        // signal, so plc_destroy() may never be called
+        uint64_t now = audio_clock_now();
+        if (now - plc->report_time >= PLC_REPORT_INTERVAL_NS) {
+            plc_report(plc);
+            plc->report_time = now;
+        }
+    }
+
+    if (!block->data) {
+        // hole reported by the backend
+        if (plc->started && block->frames) {
+            plc->trimmable = 0;
+            if (block->frames > PLC_MAX_GAP_FRAMES) {
+                // fewer frames than the hole are inserted
+                plc->reanchor = true;
+            }
+            return plc_conceal(plc, block->frames);
+        }
+        return true;
+    }
+
+    uint32_t trim;
+    if (!plc_detect_gap(plc, block, &trim)) {
+        return false;
+    }
+
+    uint64_t pts = block->pts + audio_frames_to_ns(trim);
+    const int16_t *data = &block->data[trim * AUDIO_CHANNELS];
+    uint32_t frames = block->frames - trim;
+
+    if (trim && frames) {
+        // splice: crossfade from the trimmed frames to the kept ones
+        uint32_t n = frames < PLC_CROSSFADE_FRAMES ? frames
+                                                   : PLC_CROSSFADE_FRAMES;
+        for (uint32_t i = 0; i < n; ++i) {
+            float w = (float) (i + 1) / (n + 1);
+            for (int c = 0; c < AUDIO_CHANNELS; ++c) {
+                uint32_t j = i * AUDIO_CHANNELS + c;
+                plc->buf[j] = to_s16(w * data[j] + (1 - w) * block->data[j]);
+            }
+        }
+
+        if (!plc_forward(plc, pts, plc->buf, n, false)) {
+            return false;
+        }
+
+        pts += audio_frames_to_ns(n);
+        data += n * AUDIO_CHANNELS;
+        frames -= n;
+    }
+
+    if (plc->concealing && frames) {
+        plc->concealing = false;
+
+        // crossfade from the extrapolated signal
+        uint32_t n = frames < PLC_CROSSFADE_FRAMES ? frames
+                                                   : PLC_CROSSFADE_FRAMES;
+        for (uint32_t i = 0; i < n; ++i) {
+            float w = (float) (i + 1) / (n + 1);
+            for (int c = 0; c < AUDIO_CHANNELS; ++c) {
+                uint32_t j = i * AUDIO_CHANNELS + c;
+                float value = plc_extrapolate(plc, plc->position + i, c);
+                plc->buf[j] = to_s16(w * data[j] + (1 - w) * value);
+            }
+        }
+
+        if (!plc_forward(plc, pts, plc->buf, n, true)) {
+            return false;
+        }
+
+        pts += audio_frames_to_ns(n);
+        data += n * AUDIO_CHANNELS;
+        frames -= n;
+    }
+
+    if (!frames) {
+        return true;
+    }
+
+    return plc_forward(plc, pts, data, frames, false);
+}
+
+bool
+plc_block_cb(const struct audio_block *block, void *userdata) {
+    struct plc *plc = userdata;
+    return plc_push(plc, block);
+}
@@ -0,0 +1,104 @@
+#ifndef PLC_H
+#define PLC_H
+
+#include <stdbool.h>
+
+#include "audio.h"
+
+// Packet loss concealment.
+//
+// When the host controller drops isochronous packets (e.g. on a saturated
+// hub), or when the capture overruns, the captured stream has holes, which
+// appear as discontinuities in the pts of the blocks.
+//
+// The gaps are either reported by the backend (blocks without data), or
+// detected from the pts, which are noisy: a deviation is considered as a gap
+// only beyond several times the measured jitter (and at least
+// PLC_MIN_GAP_FRAMES), and if the next block overlaps the concealed frames,
+// the overlap is trimmed, so that the jitter never adds frames in the long
+// run.
+//
+// This stage forwards the blocks to another audio_block_cb, and fills every
+// gap by repeating the last pitch period of the signal, attenuated after
+// PLC_HOLD_FRAMES and faded out over PLC_FADE_FRAMES. The first frames
+// following the gap are crossfaded from the extrapolated signal, so that
+// neither the start nor the end of the concealment produces a click.
+
+// pts deviations shorter than this are always considered as capture jitter
+#define PLC_MIN_GAP_FRAMES (AUDIO_RATE / 500) // 2 ms
+// beyond this, the stream is considered interrupted: only fade out
+#define PLC_MAX_GAP_FRAMES (AUDIO_RATE / 5) // 200 ms
+
+#define PLC_HOLD_FRAMES (AUDIO_RATE / 100) // 10 ms
+#define PLC_FADE_FRAMES (AUDIO_RATE / 20) // 50 ms
+#define PLC_CROSSFADE_FRAMES 128
+
+// pitch periods searched, from 400 Hz down to 100 Hz
+#define PLC_MIN_PERIOD (AUDIO_RATE / 400)
+#define PLC_MAX_PERIOD (AUDIO_RATE / 100)
+// must be at least 2 * PLC_MAX_PERIOD
+#define PLC_HISTORY_FRAMES 1024
+
+// the concealed frames are forwarded by blocks of at most this size
+#define PLC_BLOCK_FRAMES 256
+
+struct plc {
+    audio_block_cb cb;
+    void *userdata;
+
+    bool started;
+    // pts of the first block
+    uint64_t start_pts;
+    // frames forwarded since start_pts (concealed frames included)
+    uint64_t emitted_frames;
+    // smoothed offset between the pts and the sample clock (in ns)
+    int64_t offset;
+    // smoothed absolute deviation of the pts (in ns)
+    uint64_t jitter;
+    // frames of the last concealment which may be trimmed from the next block
+    uint64_t trimmable;
+    // the next block restarts the sample clock (after a long hole)
+    bool reanchor;
+
+    // the most recent frames forwarded
+    int16_t history[PLC_HISTORY_FRAMES * AUDIO_CHANNELS];
+    uint32_t history_frames;
+
+    // the period repeated during the concealment (0 frames for silence)
+    int16_t period[PLC_MAX_PERIOD * AUDIO_CHANNELS];
+    uint32_t period_frames;
+    // frames extrapolated since the start of the current gap
+    uint32_t position;
+    // the next block must be crossfaded from the extrapolated signal
+    bool concealing;
+
+    int16_t buf[PLC_BLOCK_FRAMES * AUDIO_CHANNELS];
+
+    // statistics
+    uint64_t concealed_frames;
+    uint64_t trimmed_frames;
+    uint32_t gaps;
+    // the statistics are logged at most once per second
+    uint32_t reported_gaps;
+    uint64_t report_time;
+};
+
+void
+plc_init(struct plc *plc, audio_block_cb cb, void *userdata);
+
+// log the statistics (they are also logged during the capture, within a
+// second after each new gap)
+void
+plc_destroy(struct plc *plc);
+
+// forward the block, preceded by the concealed frames if a gap is detected
+//
+// return false if the callback requested to stop
+bool
+plc_push(struct plc *plc, const struct audio_block *block);
+
+// to be used as an audio_block_cb, with the plc as userdata
+bool
+plc_block_cb(const struct audio_block *block, void *userdata);
+
+#endif
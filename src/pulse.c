@@ -1,15 +1,26 @@
+#define _POSIX_C_SOURCE 200809L
 #include "pulse.h"
 
 #include <assert.h>
 #include <pulse/pulseaudio.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <string.h>
 
 #include "log.h"
+#include "plc.h"
 
 #define DEVICE_NOT_FOUND_YET -1
 #define DEVICE_NOT_FOUND -2
 
+#define PULSE_CAPTURE_FRAGMENT_USEC 10000 // 10ms
+
+static const pa_sample_spec pulse_sample_spec = {
+    .format = PA_SAMPLE_S16LE,
+    .rate = AUDIO_RATE,
+    .channels = AUDIO_CHANNELS,
+};
+
 struct pulse_device_data {
     const char *req_serial;
     size_t req_serial_len;
@@ -92,48 +103,75 @@ pulse_wait_ready(pa_context *ctx, pa_mainloop *ml) {
     return ready;
 }
 
-int
-pulse_get_device_number(const char *serial) {
-    pa_mainloop *ml = pa_mainloop_new();
-    if (!ml) {
+struct pulse_connection {
+    pa_mainloop *ml;
+    pa_context *ctx;
+};
+
+static bool
+pulse_connect(struct pulse_connection *conn) {
+    conn->ml = pa_mainloop_new();
+    if (!conn->ml) {
         LOGE("Could not create PulseAudio main loop");
-        return -1;
+        return false;
     }
 
-    int ret = -1;
-
-    pa_mainloop_api *mlapi = pa_mainloop_get_api(ml);
+    pa_mainloop_api *mlapi = pa_mainloop_get_api(conn->ml);
     assert(mlapi);
 
-    pa_context *ctx = pa_context_new(mlapi, "usbaudio");
-    if (!ctx) {
+    conn->ctx = pa_context_new(mlapi, "usbaudio");
+    if (!conn->ctx) {
         LOGE("Could not create PulseAudio context");
-        goto finally_ml_free;
+        goto error_ml_free;
     }
 
-    int r = pa_context_connect(ctx, NULL, 0, NULL);
+    int r = pa_context_connect(conn->ctx, NULL, 0, NULL);
     if (r < 0) {
         LOGE("Could not connect to PulseAudio server");
-        goto finally_ctx_unref;
+        goto error_ctx_unref;
     }
 
-    bool ready = pulse_wait_ready(ctx, ml);
+    bool ready = pulse_wait_ready(conn->ctx, conn->ml);
     if (!ready) {
-        goto finally_ctx_disconnect;
+        goto error_ctx_disconnect;
     }
 
+    return true;
+
+error_ctx_disconnect:
+    pa_context_disconnect(conn->ctx);
+error_ctx_unref:
+    pa_context_unref(conn->ctx);
+error_ml_free:
+    pa_mainloop_free(conn->ml);
+
+    return false;
+}
+
+static void
+pulse_disconnect(struct pulse_connection *conn) {
+    pa_context_disconnect(conn->ctx);
+    pa_context_unref(conn->ctx);
+    pa_mainloop_free(conn->ml);
+}
+
+static int
+pulse_find_source(struct pulse_connection *conn, const char *serial) {
     struct pulse_device_data device = {
         .req_serial = serial,
         .req_serial_len = strlen(serial),
         .index = DEVICE_NOT_FOUND_YET,
     };
-    pa_operation *op =
-        pa_context_get_source_info_list(ctx, pulse_sourcelist_cb, &device);
+    pa_operation *op = pa_context_get_source_info_list(conn->ctx,
+                                                       pulse_sourcelist_cb,
+                                                       &device);
     do {
-        int r = pa_mainloop_iterate(ml, 1, NULL);
+        int r = pa_mainloop_iterate(conn->ml, 1, NULL);
         if (r <= 0) {
             LOGE("Could not iterate on main loop");
-            goto finally_ctx_disconnect;
+            pa_operation_cancel(op);
+            pa_operation_unref(op);
+            return -1;
         }
     } while (device.index == DEVICE_NOT_FOUND_YET);
     if (device.index >= 0) {
@@ -142,16 +180,299 @@ pulse_get_device_number(const char *serial) {
     }
     pa_operation_unref(op);
 
-    if (device.index >= 0) {
-        ret = device.index;
+    return device.index >= 0 ? device.index : -1;
+}
+
+int
+pulse_get_device_number(const char *serial) {
+    struct pulse_connection conn;
+    if (!pulse_connect(&conn)) {
+        return -1;
+    }
+
+    int ret = pulse_find_source(&conn, serial);
+
+    pulse_disconnect(&conn);
+    return ret;
+}
+
+struct pulse_capture_data {
+    audio_block_cb cb;
+    void *userdata;
+    bool stopped;
+    bool error;
+};
+
+static void
+pulse_stream_state_cb(pa_stream *stream, void *userdata) {
+    struct pulse_capture_data *data = userdata;
+    pa_stream_state_t state = pa_stream_get_state(stream);
+    if (state == PA_STREAM_READY) {
+        // the blocks are not forwarded until the latency is known, do not
+        // wait for the first automatic timing update
+        pa_operation *op = pa_stream_update_timing_info(stream, NULL, NULL);
+        if (op) {
+            pa_operation_unref(op);
+        }
+    } else if (state == PA_STREAM_FAILED || state == PA_STREAM_TERMINATED) {
+        LOGE("PulseAudio record stream terminated");
+        data->stopped = true;
+        data->error = true;
+    }
+}
+
+// return false if there is no timing info yet
+static bool
+pulse_get_capture_latency(pa_stream *stream, uint64_t *latency) {
+    pa_usec_t usec;
+    int negative;
+    if (pa_stream_get_latency(stream, &usec, &negative) < 0) {
+        return false;
+    }
+    *latency = negative ? 0 : usec * 1000;
+    return true;
+}
+
+static void
+pulse_stream_read_cb(pa_stream *stream, size_t nbytes, void *userdata) {
+    (void) nbytes;
+    struct pulse_capture_data *data = userdata;
+
+    while (!data->stopped && pa_stream_readable_size(stream) > 0) {
+        const void *samples;
+        size_t len;
+        if (pa_stream_peek(stream, &samples, &len) < 0) {
+            LOGE("Could not read PulseAudio record stream");
+            data->stopped = true;
+            data->error = true;
+            return;
+        }
+
+        if (!len) {
+            // buffer empty
+            return;
+        }
+
+        // For record streams, the latency is the time elapsed since the
+        // capture of the next sample to be read, i.e. the first sample of
+        // this fragment.
+        uint64_t now = audio_clock_now();
+        uint64_t latency;
+        if (pulse_get_capture_latency(stream, &latency)) {
+            struct audio_block block = {
+                .pts = now - latency,
+                .frames = len / AUDIO_FRAME_SIZE,
+                // NULL if there is a hole in the stream
+                .data = samples,
+            };
+            if (!data->cb(&block, data->userdata)) {
+                data->stopped = true;
+            }
+        } else {
+            // Without timing info, the pts could not be compensated (and
+            // would jump backwards once it is received): drop the fragment.
+            LOGD("No PulseAudio timing info yet, %zu bytes dropped", len);
+        }
+
+        pa_stream_drop(stream);
+    }
+}
+
+static bool
+pulse_record(struct pulse_connection *conn, int index, audio_block_cb cb,
+             void *userdata) {
+    pa_stream *stream = pa_stream_new(conn->ctx, "usbaudio capture",
+                                      &pulse_sample_spec, NULL);
+    if (!stream) {
+        LOGE("Could not create PulseAudio record stream");
+        return false;
+    }
+
+    bool ret = false;
+
+    struct pulse_capture_data data = {
+        .cb = cb,
+        .userdata = userdata,
+        .stopped = false,
+        .error = false,
+    };
+    pa_stream_set_state_callback(stream, pulse_stream_state_cb, &data);
+    pa_stream_set_read_callback(stream, pulse_stream_read_cb, &data);
+
+    // request small fragments, so that blocks are delivered (and
+    // timestamped) as soon as possible
+    pa_buffer_attr attr = {
+        .maxlength = (uint32_t) -1,
+        .tlength = (uint32_t) -1,
+        .prebuf = (uint32_t) -1,
+        .minreq = (uint32_t) -1,
+        .fragsize = pa_usec_to_bytes(PULSE_CAPTURE_FRAGMENT_USEC,
+                                     &pulse_sample_spec),
+    };
+
+    char source[16];
+    snprintf(source, sizeof(source), "%d", index);
+
+    pa_stream_flags_t flags = PA_STREAM_ADJUST_LATENCY
+                            | PA_STREAM_INTERPOLATE_TIMING
+                            | PA_STREAM_AUTO_TIMING_UPDATE;
+    if (pa_stream_connect_record(stream, source, &attr, flags) < 0) {
+        LOGE("Could not connect PulseAudio record stream");
+        goto finally_stream_unref;
+    }
+
+    LOGI("Capturing PulseAudio input source %d", index);
+
+    while (!data.stopped) {
+        int r = pa_mainloop_iterate(conn->ml, 1, NULL);
+        if (r < 0) {
+            LOGE("Could not iterate on main loop");
+            data.error = true;
+            break;
+        }
+    }
+
+    ret = !data.error;
+
+    pa_stream_disconnect(stream);
+finally_stream_unref:
+    pa_stream_set_state_callback(stream, NULL, NULL);
+    pa_stream_set_read_callback(stream, NULL, NULL);
+    pa_stream_unref(stream);
+
+    return ret;
+}
+
+bool
+pulse_capture(int index, audio_block_cb cb, void *userdata) {
+    struct pulse_connection conn;
+    if (!pulse_connect(&conn)) {
+        return false;
     }
 
-finally_ctx_disconnect:
-    pa_context_disconnect(ctx);
-finally_ctx_unref:
-    pa_context_unref(ctx);
-finally_ml_free:
-    pa_mainloop_free(ml);
+    bool ret = pulse_record(&conn, index, cb, userdata);
 
+    pulse_disconnect(&conn);
     return ret;
 }
+
+struct pulse_playback {
+    pa_stream *stream;
+    uint64_t dropped; // in frames
+};
+
+static bool
+pulse_playback_cb(const struct audio_block *block, void *userdata) {
+    struct pulse_playback *playback = userdata;
+    if (!block->data) {
+        // lost frames, not concealed
+        return true;
+    }
+
+    pa_stream_state_t state = pa_stream_get_state(playback->stream);
+    if (state == PA_STREAM_FAILED || state == PA_STREAM_TERMINATED) {
+        LOGE("PulseAudio playback stream terminated");
+        return false;
+    }
+    if (state != PA_STREAM_READY) {
+        // the frames captured until the playback stream is ready are dropped
+        return true;
+    }
+
+    size_t len = block->frames * AUDIO_FRAME_SIZE;
+    size_t writable = pa_stream_writable_size(playback->stream);
+    if (writable < len) {
+        // the playback clock is slower than the capture clock: do not let
+        // the buffer (so the latency) grow beyond its target length
+        if (!playback->dropped) {
+            LOGW("PulseAudio playback: buffer full, dropping frames");
+        }
+        writable -= writable % AUDIO_FRAME_SIZE;
+        playback->dropped += (len - writable) / AUDIO_FRAME_SIZE;
+        len = writable;
+    }
+
+    if (len && pa_stream_write(playback->stream, block->data, len, NULL, 0,
+                               PA_SEEK_RELATIVE) < 0) {
+        LOGE("Could not write PulseAudio playback stream");
+        return false;
+    }
+
+    return true;
+}
+
+// capture the input source and play it to a playback stream, within the
+// same main loop, so that the lost frames can be concealed
+static bool
+pulse_play(int index, const struct play_params *params) {
+    struct pulse_connection conn;
+    if (!pulse_connect(&conn)) {
+        return false;
+    }
+
+    bool ok = false;
+
+    struct pulse_playback playback = {
+        .stream = pa_stream_new(conn.ctx, "usbaudio playback",
+                                &pulse_sample_spec, NULL),
+        .dropped = 0,
+    };
+    if (!playback.stream) {
+        LOGE("Could not create PulseAudio playback stream");
+        goto finally_disconnect;
+    }
+
+    // the target length of the buffer is the playback latency
+    pa_buffer_attr attr = {
+        .maxlength = (uint32_t) -1,
+        .tlength = pa_usec_to_bytes(params->live_caching * PA_USEC_PER_MSEC,
+                                    &pulse_sample_spec),
+        .prebuf = (uint32_t) -1,
+        .minreq = (uint32_t) -1,
+        .fragsize = (uint32_t) -1,
+    };
+
+    // NULL for the default sink
+    if (pa_stream_connect_playback(playback.stream, params->device, &attr,
+                                   PA_STREAM_ADJUST_LATENCY, NULL,
+                                   NULL) < 0) {
+        LOGE("Could not connect PulseAudio playback stream");
+        goto finally_stream_unref;
+    }
+
+    LOGI("Playing to PulseAudio sink %s",
+         params->device ? params->device : "(default)");
+
+    if (params->conceal) {
+        struct plc plc;
+        plc_init(&plc, pulse_playback_cb, &playback);
+        ok = pulse_record(&conn, index, plc_block_cb, &plc);
+        plc_destroy(&plc);
+    } else {
+        ok = pulse_record(&conn, index, pulse_playback_cb, &playback);
+    }
+    if (playback.dropped) {
+        LOGW("PulseAudio playback: %" PRIu64 " frames dropped",
+             playback.dropped);
+    }
+
+    pa_stream_disconnect(playback.stream);
+finally_stream_unref:
+    pa_stream_unref(playback.stream);
+finally_disconnect:
+    pulse_disconnect(&conn);
+
+    return ok;
+}
+
+const struct backend pulse_backend = {
+    .name = "pulse",
+    .find_source = pulse_get_device_number,
+    .capture = pulse_capture,
+    .play = pulse_play,
+};
+
+#ifdef BACKEND_MODULE
+// entry point of the module, see backend_load()
+const struct backend *usbaudio_backend = &pulse_backend;
+#endif
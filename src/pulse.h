@@ -1,8 +1,21 @@
 #ifndef PULSE_H
 #define PULSE_H
 
+#include <stdbool.h>
+
+#include "audio.h"
+#include "backend.h"
+
+extern const struct backend pulse_backend;
+
 // return -1 on error
 int
 pulse_get_device_number(const char *serial);
 
+// capture the PulseAudio input source until cb returns false
+//
+// return false on error
+bool
+pulse_capture(int index, audio_block_cb cb, void *userdata);
+
 #endif
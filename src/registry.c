@@ -0,0 +1,350 @@
+#include "registry.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+
+#define INITIAL_BUCKET_COUNT 16
+
+static uint32_t
+hash_string(const char *s) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (; *s; ++s) {
+        hash ^= (uint8_t) *s;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t
+hash_vid_pid(uint16_t vid, uint16_t pid) {
+    // Fibonacci hashing, the high bits are the well-mixed ones
+    uint32_t hash = ((uint32_t) vid << 16 | pid) * 2654435769u;
+    return hash ^ (hash >> 16);
+}
+
+static inline size_t
+bucket(const struct usb_registry *registry, uint32_t hash) {
+    return hash & (registry->bucket_count - 1);
+}
+
+static bool
+alloc_buckets(size_t count, struct usb_device ***by_serial,
+              struct usb_device ***by_path, struct usb_device ***by_vid_pid) {
+    *by_serial = calloc(count, sizeof(**by_serial));
+    *by_path = calloc(count, sizeof(**by_path));
+    *by_vid_pid = calloc(count, sizeof(**by_vid_pid));
+    if (!*by_serial || !*by_path || !*by_vid_pid) {
+        free(*by_serial);
+        free(*by_path);
+        free(*by_vid_pid);
+        return false;
+    }
+    return true;
+}
+
+static void
+free_buckets(struct usb_registry *registry) {
+    free(registry->by_serial);
+    free(registry->by_path);
+    free(registry->by_vid_pid);
+}
+
+static void
+index_by_serial(struct usb_registry *registry, struct usb_device *device) {
+    struct usb_device **head =
+        &registry->by_serial[bucket(registry, hash_string(device->serial))];
+    device->next_by_serial = *head;
+    *head = device;
+}
+
+static void
+index_device(struct usb_registry *registry, struct usb_device *device) {
+    if (device->serial) {
+        index_by_serial(registry, device);
+    }
+
+    struct usb_device **head =
+        &registry->by_path[bucket(registry, hash_string(device->path))];
+    device->next_by_path = *head;
+    *head = device;
+
+    head = &registry->by_vid_pid[bucket(registry,
+                                        hash_vid_pid(device->vid,
+                                                     device->pid))];
+    device->next_by_vid_pid = *head;
+    *head = device;
+}
+
+bool
+usb_registry_init(struct usb_registry *registry,
+                  usb_serial_reader read_serial, usb_adb_checker has_adb) {
+    registry->read_serial = read_serial;
+    registry->has_adb = has_adb;
+    registry->head = NULL;
+    registry->count = 0;
+    registry->unread_serials = 0;
+    registry->bucket_count = INITIAL_BUCKET_COUNT;
+    if (!alloc_buckets(registry->bucket_count, &registry->by_serial,
+                       &registry->by_path, &registry->by_vid_pid)) {
+        LOGE("Could not allocate USB registry");
+        return false;
+    }
+    arena_init(&registry->strings);
+    return true;
+}
+
+void
+usb_registry_destroy(struct usb_registry *registry) {
+    struct usb_device *device = registry->head;
+    while (device) {
+        struct usb_device *next = device->next;
+        libusb_unref_device(device->device);
+        free(device);
+        device = next;
+    }
+    free_buckets(registry);
+    arena_destroy(&registry->strings);
+}
+
+static bool
+grow(struct usb_registry *registry) {
+    size_t bucket_count = registry->bucket_count * 2;
+    struct usb_device **by_serial;
+    struct usb_device **by_path;
+    struct usb_device **by_vid_pid;
+    if (!alloc_buckets(bucket_count, &by_serial, &by_path, &by_vid_pid)) {
+        return false;
+    }
+
+    free_buckets(registry);
+    registry->bucket_count = bucket_count;
+    registry->by_serial = by_serial;
+    registry->by_path = by_path;
+    registry->by_vid_pid = by_vid_pid;
+
+    for (struct usb_device *d = registry->head; d; d = d->next) {
+        index_device(registry, d);
+    }
+    return true;
+}
+
+struct usb_device *
+usb_registry_add(struct usb_registry *registry, libusb_device *device,
+                 uint16_t vid, uint16_t pid, const char *path) {
+    if (registry->count >= registry->bucket_count && !grow(registry)) {
+        // keep the current buckets, the lookups are just slower
+        LOGW("Could not grow USB registry");
+    }
+
+    struct usb_device *usb_device = malloc(sizeof(*usb_device));
+    if (!usb_device) {
+        LOGE("Could not allocate USB device");
+        return NULL;
+    }
+
+    usb_device->path = arena_strdup(&registry->strings, path);
+    if (!usb_device->path) {
+        LOGE("Could not allocate USB device path");
+        free(usb_device);
+        return NULL;
+    }
+
+    usb_device->vid = vid;
+    usb_device->pid = pid;
+    usb_device->serial = NULL;
+    usb_device->device = libusb_ref_device(device);
+    usb_device->serial_read = false;
+    usb_device->adb_checked = false;
+    usb_device->adb = false;
+
+    usb_device->prev = NULL;
+    usb_device->next = registry->head;
+    if (registry->head) {
+        registry->head->prev = usb_device;
+    }
+    registry->head = usb_device;
+    registry->count++;
+    registry->unread_serials++;
+
+    index_device(registry, usb_device);
+    return usb_device;
+}
+
+enum chain {
+    CHAIN_SERIAL,
+    CHAIN_PATH,
+    CHAIN_VID_PID,
+};
+
+static struct usb_device **
+next_link(struct usb_device *device, enum chain chain) {
+    switch (chain) {
+        case CHAIN_SERIAL:
+            return &device->next_by_serial;
+        case CHAIN_PATH:
+            return &device->next_by_path;
+        default: // CHAIN_VID_PID
+            return &device->next_by_vid_pid;
+    }
+}
+
+static void
+unlink_chain(struct usb_device **head, struct usb_device *device,
+             enum chain chain) {
+    for (struct usb_device **p = head; *p; p = next_link(*p, chain)) {
+        if (*p == device) {
+            *p = *next_link(device, chain);
+            return;
+        }
+    }
+}
+
+void
+usb_registry_remove(struct usb_registry *registry, struct usb_device *device) {
+    if (device->serial) {
+        unlink_chain(&registry->by_serial[bucket(registry,
+                                          hash_string(device->serial))],
+                     device, CHAIN_SERIAL);
+    }
+    unlink_chain(&registry->by_path[bucket(registry,
+                                           hash_string(device->path))],
+                 device, CHAIN_PATH);
+    unlink_chain(&registry->by_vid_pid[bucket(registry,
+                                              hash_vid_pid(device->vid,
+                                                           device->pid))],
+                 device, CHAIN_VID_PID);
+
+    if (device->prev) {
+        device->prev->next = device->next;
+    } else {
+        registry->head = device->next;
+    }
+    if (device->next) {
+        device->next->prev = device->prev;
+    }
+    registry->count--;
+    if (!device->serial_read) {
+        registry->unread_serials--;
+    }
+
+    libusb_unref_device(device->device);
+    free(device);
+
+    if (!registry->count) {
+        // the strings of the removed devices are not reclaimed individually
+        arena_destroy(&registry->strings);
+        arena_init(&registry->strings);
+    }
+}
+
+struct usb_device *
+usb_registry_find_by_path(struct usb_registry *registry, const char *path) {
+    struct usb_device *d =
+        registry->by_path[bucket(registry, hash_string(path))];
+    for (; d; d = d->next_by_path) {
+        if (!strcmp(d->path, path)) {
+            return d;
+        }
+    }
+    return NULL;
+}
+
+const char *
+usb_registry_get_serial(struct usb_registry *registry,
+                        struct usb_device *device) {
+    if (device->serial_read) {
+        return device->serial;
+    }
+
+    device->serial_read = true;
+    registry->unread_serials--;
+
+    char serial[128];
+    if (!registry->read_serial(device->device, serial, sizeof(serial))) {
+        return NULL;
+    }
+
+    device->serial = arena_strdup(&registry->strings, serial);
+    if (!device->serial) {
+        LOGE("Could not allocate USB device serial");
+        return NULL;
+    }
+
+    index_by_serial(registry, device);
+    return device->serial;
+}
+
+static bool
+has_adb(struct usb_registry *registry, struct usb_device *device) {
+    if (!device->adb_checked) {
+        device->adb = registry->has_adb(device->device);
+        device->adb_checked = true;
+    }
+    return device->adb;
+}
+
+// the devices matching a lookup by adb interface or by vid:pid are ignored if
+// their serial cannot be read (they could not be found again once in
+// accessory mode)
+static bool
+has_serial(struct usb_registry *registry, struct usb_device *device) {
+    bool first_read = !device->serial_read;
+    if (usb_registry_get_serial(registry, device)) {
+        return true;
+    }
+    if (first_read) {
+        LOGW("Could not read serial of device %s [%04x:%04x], ignored",
+             device->path, device->vid, device->pid);
+    }
+    return false;
+}
+
+struct usb_device *
+usb_registry_find(struct usb_registry *registry, const struct lookup *lookup,
+                  struct usb_device *prev) {
+    struct usb_device *d;
+    switch (lookup->type) {
+        case LOOKUP_BY_ADB_INTERFACE:
+            // not indexed, the adb interface is only used when no device is
+            // specified
+            d = prev ? prev->next : registry->head;
+            for (; d; d = d->next) {
+                if (has_adb(registry, d) && has_serial(registry, d)) {
+                    return d;
+                }
+            }
+            return NULL;
+        case LOOKUP_BY_SERIAL:
+            if (!prev && registry->unread_serials) {
+                // every device must be indexed by serial
+                for (d = registry->head; d; d = d->next) {
+                    usb_registry_get_serial(registry, d);
+                }
+            }
+            d = prev ? prev->next_by_serial
+                     : registry->by_serial[bucket(registry,
+                                           hash_string(lookup->serial))];
+            for (; d; d = d->next_by_serial) {
+                if (!strcmp(d->serial, lookup->serial)) {
+                    return d;
+                }
+            }
+            return NULL;
+        case LOOKUP_BY_VID_PID:
+            d = prev ? prev->next_by_vid_pid
+                     : registry->by_vid_pid[bucket(registry,
+                                            hash_vid_pid(lookup->vid,
+                                                         lookup->pid))];
+            for (; d; d = d->next_by_vid_pid) {
+                if (d->vid == lookup->vid && d->pid == lookup->pid
+                        && has_serial(registry, d)) {
+                    return d;
+                }
+            }
+            return NULL;
+    }
+    return NULL;
+}
@@ -0,0 +1,117 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <libusb-1.0/libusb.h>
+
+#include "arena.h"
+
+enum lookup_type {
+    // devices supporting adb
+    LOOKUP_BY_ADB_INTERFACE,
+    // devices having the provided serial
+    LOOKUP_BY_SERIAL,
+    // devices having the provided vid:pid
+    LOOKUP_BY_VID_PID,
+};
+
+struct lookup {
+    enum lookup_type type;
+    union {
+        const char *serial;
+        struct {
+            uint16_t vid;
+            uint16_t pid;
+        };
+    };
+};
+
+struct usb_device {
+    uint16_t vid;
+    uint16_t pid;
+    // read on demand (see usb_registry_get_serial()), NULL if not read yet or
+    // if it could not be read
+    char *serial;
+    char *path; // "bus-port.port...", unique for connected devices
+    libusb_device *device;
+
+    // registry internals
+    bool serial_read;
+    bool adb_checked;
+    bool adb; // has an adb interface (valid if adb_checked)
+    struct usb_device *prev;
+    struct usb_device *next;
+    struct usb_device *next_by_serial;
+    struct usb_device *next_by_path;
+    struct usb_device *next_by_vid_pid;
+};
+
+// read the serial of the device into serial (of size len)
+//
+// return false if the device has no readable serial
+typedef bool (*usb_serial_reader)(libusb_device *device, char *serial,
+                                  size_t len);
+
+// return true if the device has an adb interface
+typedef bool (*usb_adb_checker)(libusb_device *device);
+
+// Connected USB devices, indexed by serial, path and vid:pid.
+//
+// There is no fixed capacity: the hash tables grow with the number of
+// devices, and the strings are stored in an arena.
+//
+// Reading the serial requires to open the device, which is slow, so it is
+// only read when a lookup needs it: a device is indexed by serial once its
+// serial is read.
+struct usb_registry {
+    usb_serial_reader read_serial;
+    usb_adb_checker has_adb;
+    struct usb_device *head; // all devices
+    size_t count;
+    size_t unread_serials; // number of devices whose serial is not read yet
+    size_t bucket_count; // power of 2
+    struct usb_device **by_serial;
+    struct usb_device **by_path;
+    struct usb_device **by_vid_pid;
+    struct arena strings;
+};
+
+bool
+usb_registry_init(struct usb_registry *registry,
+                  usb_serial_reader read_serial, usb_adb_checker has_adb);
+
+void
+usb_registry_destroy(struct usb_registry *registry);
+
+// the path is copied and a reference to the libusb device is acquired
+//
+// return NULL on allocation failure
+struct usb_device *
+usb_registry_add(struct usb_registry *registry, libusb_device *device,
+                 uint16_t vid, uint16_t pid, const char *path);
+
+void
+usb_registry_remove(struct usb_registry *registry, struct usb_device *device);
+
+struct usb_device *
+usb_registry_find_by_path(struct usb_registry *registry, const char *path);
+
+// read the serial of the device if not done yet
+//
+// return NULL if it could not be read
+const char *
+usb_registry_get_serial(struct usb_registry *registry,
+                        struct usb_device *device);
+
+// return the first device matching the lookup if prev is NULL, or the next
+// one after prev, or NULL if there is no (more) matching device
+//
+// the devices whose serial could not be read never match (their serial is
+// read only once they match otherwise)
+struct usb_device *
+usb_registry_find(struct usb_registry *registry, const struct lookup *lookup,
+                  struct usb_device *prev);
+
+#endif